@@ -13,9 +13,40 @@
 
 using namespace arma;
 
+//Read-only memory map of a whole file, unmapped on destruction
+class MappedFile
+{
+
+private:
+  const char  *data;
+  size_t      length;
+  
+  MappedFile(const MappedFile &);
+  MappedFile& operator=(const MappedFile &);
+  
+public:
+  MappedFile(const std::string &path);
+  ~MappedFile();
+  
+  const char* begin() const;
+  const char* end() const;
+  size_t size() const;
+};
+
+/*
+ * Wigner-Seitz images from _wsvec.dat. Entry i (the i-th row of _hr.dat) has
+ * the images offsets(i) .. offsets(i + 1) - 1, each a column of shifts in
+ * lattice coordinates; its degeneracy is offsets(i + 1) - offsets(i).
+ */
+struct WsVecs
+{
+  Mat<s16>  shifts;
+  uvec      offsets;
+};
+
 std::vector<mat> read_hrFile(std::string seedname);
 Lattice readWinFile(std::string seedname);
-std::vector<mat> read_wsvecFile(std::string seedname);
+WsVecs read_wsvecFile(std::string seedname);
 
 
 #endif /* dataInput_hpp */
@@ -0,0 +1,164 @@
+//
+//  fixedKernels.hpp
+//
+//
+//  Hamiltonian and eigenvalue kernels for small, fixed orbital counts.
+//
+//
+
+#ifndef fixedKernels_hpp
+#define fixedKernels_hpp
+
+#include "tb_help.hpp"
+
+/*
+ * The kernels work on the Hermitian half table of TightBinding: R is the
+ * nPairs x D matrix of lattice vectors (column-major), upper/lower hold the
+ * packed upper triangles of T(R) and T(-R), one column of N(N+1)/2 entries
+ * per pair. With D and N known at compile time every work array lives on the
+ * stack and the inner loops have constant trip counts the compiler unrolls.
+ */
+typedef void (*FixedHamKernel)(const double *R, const cx_double *upper, const cx_double *lower,
+                               uword nPairs, const double *k, cx_double *H);
+typedef double (*FixedGapKernel)(const double *R, const cx_double *upper, const cx_double *lower,
+                                 uword nPairs, const double *k);
+
+#define fixedChunk 64   //phases evaluated per call of the sin/cos kernel
+
+//H(k) into the column-major N x N array H
+template<int D, int N>
+inline void
+fixedHam(const double *R, const cx_double *upper, const cx_double *lower,
+         uword nPairs, const double *k, cx_double *H)
+{
+  const int   P = N * (N + 1) / 2;
+  double      re[P],
+              im[P],
+              kR[fixedChunk];
+  cx_double   ph[fixedChunk];
+
+  for(int p = 0; p < P; p++)
+  {
+    re[p] = im[p] = 0;
+  }
+  for(uword r0 = 0; r0 < nPairs; r0 += fixedChunk)
+  {
+    int   len = std::min<uword>(fixedChunk, nPairs - r0);
+    for(int r = 0; r < len; r++)
+    {
+      double  s = 0;
+      for(int d = 0; d < D; d++)
+      {
+        s += R[r0 + r + d * nPairs] * k[d];
+      }
+      kR[r] = s;
+    }
+    cexp(kR, ph, len);
+
+    //T(R) e + T(-R) conj(e), written out in real arithmetic
+    for(int r = 0; r < len; r++)
+    {
+      const double  *up = reinterpret_cast<const double *>(upper + (r0 + r) * P),
+                    *lo = reinterpret_cast<const double *>(lower + (r0 + r) * P),
+                    c = ph[r].real(),
+                    s = ph[r].imag();
+      for(int p = 0; p < P; p++)
+      {
+        re[p] += (up[2 * p] + lo[2 * p]) * c + (lo[2 * p + 1] - up[2 * p + 1]) * s;
+        im[p] += (up[2 * p + 1] + lo[2 * p + 1]) * c + (up[2 * p] - lo[2 * p]) * s;
+      }
+    }
+  }
+
+  int   ind = 0;
+  for(int b = 0; b < N; b++)
+  {
+    for(int a = 0; a <= b; a++, ind++)
+    {
+      H[b + a * N] = cx_double(re[ind], -im[ind]);
+      H[a + b * N] = cx_double(re[ind], im[ind]);
+    }
+  }
+}
+
+//Eigenvalues (ascending) of the N x N Hermitian array H, which is overwritten
+template<int N>
+inline void
+fixedEigs(cx_double *H, double *eigs)
+{
+  char        jobz = 'N',
+              uplo = 'U';
+  blas_int    n = N,
+              lda = N,
+              lwork = 34 * N,
+              info = 0;
+  cx_double   work[34 * N];
+  double      rwork[3 * N - 2];
+
+  lapack::heev(&jobz, &uplo, &n, H, &lda, eigs, work, &lwork, rwork, &info);
+  if(info != 0)
+  {
+    throw "function fixedEigs : zheev failed";
+  }
+}
+
+//Gap between the two middle bands, without touching the heap
+template<int D, int N>
+inline double
+fixedGap(const double *R, const cx_double *upper, const cx_double *lower,
+         uword nPairs, const double *k)
+{
+  cx_double   A[N * N];
+  double      eigs[N];
+
+  fixedHam<D, N>(R, upper, lower, nPairs, k, A);
+  fixedEigs<N>(A, eigs);
+  return eigs[N / 2] - eigs[N / 2 - 1];
+}
+
+template<int D>
+inline bool
+selectFixed(int N, FixedHamKernel &ham, FixedGapKernel &gap)
+{
+  switch(N)
+  {
+    case 4:
+      ham = fixedHam<D, 4>;
+      gap = fixedGap<D, 4>;
+      return true;
+    case 8:
+      ham = fixedHam<D, 8>;
+      gap = fixedGap<D, 8>;
+      return true;
+    case 16:
+      ham = fixedHam<D, 16>;
+      gap = fixedGap<D, 16>;
+      return true;
+    case 32:
+      ham = fixedHam<D, 32>;
+      gap = fixedGap<D, 32>;
+      return true;
+  }
+  ham = NULL;
+  gap = NULL;
+  return false;
+}
+
+//Picks the kernels for a dim-dimensional lattice with N orbitals, if any
+inline bool
+selectFixedKernels(int dim, int N, FixedHamKernel &ham, FixedGapKernel &gap)
+{
+  if(dim == 2)
+  {
+    return selectFixed<2>(N, ham, gap);
+  }
+  if(dim == 3)
+  {
+    return selectFixed<3>(N, ham, gap);
+  }
+  ham = NULL;
+  gap = NULL;
+  return false;
+}
+
+#endif /* fixedKernels_hpp */
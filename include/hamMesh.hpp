@@ -0,0 +1,66 @@
+//
+//  hamMesh.hpp
+//
+//
+//  H(k) on a uniform Brillouin-zone mesh by FFT of the hopping table.
+//
+//
+
+#ifndef hamMesh_hpp
+#define hamMesh_hpp
+
+#include "tightBinding.hpp"
+
+/*
+ * Walks the mesh k = kVecs * (i1/n1, i2/n2, i3/n3), 0 <= i < n, and hands out
+ * H(k) at every point. The hopping blocks T(R) are scattered onto an R-grid
+ * folded modulo the mesh; for each residue of R_1 mod n1 the (R_2, R_3) plane
+ * is inverse-FFT'd once per orbital pair at construction. Each i1 slab is
+ * then the sum of those planes weighted by exp(2 pi i i1 R_1 / n1), so a full
+ * pass costs O(N^2 N_k (log N_k + residues of R_1)) and holds only
+ * N^2 * residues * n2 * n3 values at a time. For a 2D lattice n3 is ignored.
+ *
+ * With order 1 the blocks i R_a T(R) (R cartesian) are scattered onto the
+ * same grid alongside T(R), so dH/dk_a comes out of the same transforms as
+ * H, at (1 + dim) times the memory. The tables take
+ * 16 numTerms n2 n3 (residues + 2) bytes; meshes above an 8 GB budget are
+ * refused with a std::string error rather than left to exhaust memory.
+ *
+ *   HamMesh mesh(tb, n, n, n);
+ *   while(mesh.next())
+ *   {
+ *     eig_sym(energies, mesh.H());
+ *     ...mesh.k()...
+ *   }
+ */
+class HamMesh
+{
+
+private:
+  int       hamSize,
+            numTerms,   //hamSize^2 for H, times (1 + dim) with dH/dk
+            n1, n2, n3,
+            slab,       //current i1
+            point;      //current (i2, i3) within the slab, i2 fastest
+  ivec      residues;   //distinct R_1 mod n1 present in the table
+  mat       kVecs;
+  cx_cube   planes;     //numTerms x (n2 n3) per residue, orbital pair fastest
+  cx_mat    slabH;      //numTerms x (n2 n3), H (and dH) of every point in the current slab
+  cx_mat    Hk;
+  cx_cube   dHk;
+
+  void computeSlab();
+
+public:
+  HamMesh(const TightBinding &tb, int m1, int m2, int m3 = 1, int order = 0);
+
+  bool next();
+  void restart();
+  int size() const;
+  const cx_mat &H() const;
+  const cx_cube &dH() const;
+  ivec index() const;
+  vec k() const;
+};
+
+#endif /* hamMesh_hpp */
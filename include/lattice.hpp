@@ -22,15 +22,16 @@ private:
                            kPtsTo;
 public:
   Lattice();
-  Lattice(mat &lat, cube &ks, std::vector<std::string> &kFrom, std::vector<std::string> &kTo);
+  Lattice(const mat &lat, const cube &ks, const std::vector<std::string> &kFrom, const std::vector<std::string> &kTo);
   Lattice(const Lattice &other);
 
-	mat latticeVectors();
-	mat kVectors();
-  cube kPoints();
-  std::vector<std::string> kPt_names_from();
-  std::vector<std::string> kPt_names_to();
-  unsigned dim();
+  //views of the stored members, valid as long as the Lattice
+	const mat& latticeVectors() const;
+	const mat& kVectors() const;
+  const cube& kPoints() const;
+  const std::vector<std::string>& kPt_names_from() const;
+  const std::vector<std::string>& kPt_names_to() const;
+  unsigned dim() const;
 };
 
 
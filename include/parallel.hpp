@@ -0,0 +1,54 @@
+//
+//  parallel.hpp
+//  
+//
+//  Thread pool helpers for the k-point loops.
+//
+//
+
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+int defaultThreads();
+void stealingFor(int numTasks, int numThreads, std::function<void(int, int)> body);
+
+/*
+ * Runs body(task, thread) for task = 0 .. numTasks - 1 on numThreads worker
+ * threads. Tasks are handed out in increasing order, and wait(task) blocks
+ * until a given task has finished, so results can be consumed in order while
+ * later tasks are still running. An exception thrown by body is rethrown
+ * from wait. The destructor joins the workers.
+ */
+class TaskPool
+{
+
+private:
+  int                                 numTasks;
+  std::function<void(int, int)>       body;
+  std::atomic<int>                    next;
+  std::vector<char>                   done;
+  std::vector<std::exception_ptr>     errors;
+  std::mutex                          lock;
+  std::condition_variable             finished;
+  std::vector<std::thread>            workers;
+  
+  void run(int thread);
+  
+public:
+  TaskPool(int tasks, int threads, std::function<void(int, int)> f);
+  ~TaskPool();
+  
+  void wait(int task);
+  void waitAll();
+};
+
+#endif /* parallel_hpp */
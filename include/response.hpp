@@ -0,0 +1,48 @@
+//
+//  response.hpp
+//
+//
+//  Photocurrent response tensors on a frequency grid.
+//
+//
+
+#ifndef response_hpp
+#define response_hpp
+
+#include "tb_help.hpp"
+
+/*
+ * A rank-3 response tensor chi(a, b, c) at every frequency of an ascending
+ * grid, as integrated by TightBinding::injectionTensor and shiftTensor. The
+ * current for a field of (complex) polarisation e is the contraction
+ *
+ *   j_a(omega) = sum_bc chi(a, b, c, omega) e_b conj(e_c),
+ *
+ * which needs no further k-space work, so any number of polarisations can
+ * be evaluated from one integration:
+ *
+ *   ResponseTensor eta = tb.injectionTensor(omegas);
+ *   for(...) eta.current(ResponseTensor::linear(x, y, theta))...
+ */
+class ResponseTensor
+{
+
+private:
+  vec       omegas;
+  cx_cube   chi;      //(a, b + dim c, omega), i.e. each slice is chi(a, b, c) in column-major order
+
+public:
+  ResponseTensor();
+  ResponseTensor(const vec &frequencies, const cx_cube &tensor);
+
+  int dim() const;
+  const vec& frequencies() const;
+  cx_cube tensor(uword i) const;
+  cx_mat current(const cx_vec &e) const;
+  mat realCurrent(const cx_vec &e) const;
+
+  static cx_vec linear(const vec &u, const vec &v, double angle);
+  static cx_vec circular(const vec &u, const vec &v, int helicity);
+};
+
+#endif /* response_hpp */
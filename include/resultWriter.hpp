@@ -0,0 +1,72 @@
+//
+//  resultWriter.hpp
+//
+//
+//  Buffered text and binary columnar output of k-resolved results.
+//
+//
+
+#ifndef resultWriter_hpp
+#define resultWriter_hpp
+
+#include "tb_help.hpp"
+#include <cstdio>
+
+#define textOutput    1   //whitespace separated .dat columns (plus .gnu scripts)
+#define binaryOutput  2   //.tbcol columnar file
+#define textBuffer    (1 << 22)
+
+/*
+ * Text rows written into a private buffer of textBuffer bytes and handed to
+ * the file only when it fills, never per line. Numbers are formatted with
+ * std::to_chars; doubles use %g style with the given precision, so the output
+ * matches the ostream << setprecision(...) it replaces.
+ *
+ *   TextWriter out(path);
+ *   out.field(x); out.field(E); out.endRow();
+ */
+class TextWriter
+{
+
+private:
+  FILE              *out;
+  std::vector<char> buf;
+  size_t            used;
+  int               precision;
+  bool              rowStart;
+
+  TextWriter(const TextWriter &);
+  TextWriter& operator=(const TextWriter &);
+
+  void reserve(size_t n);
+  void separate();
+
+public:
+  TextWriter(const std::string &path, int digits = 16, size_t bufSize = textBuffer);
+  ~TextWriter();
+
+  void field(double x);
+  void field(long i);
+  void field(int i);
+  void endRow();
+  void flush();
+};
+
+/*
+ * Binary columnar results, "<name>.tbcol". Little-endian, every section
+ * padded to 8 bytes:
+ *
+ *   "TBCOLS\0\0", uint64 version
+ *   uint64 nRows, nCols, kDim
+ *   float64 k[kDim x nRows]    cartesian k of each row, one point per column
+ *   int64   index[nCols]       0-based band index of each column, -1 if unknown
+ *   float64 data[nRows x nCols] column-major, i.e. one contiguous block per column
+ *
+ * Entries without a value (e.g. a band outside the window at that k) are NaN.
+ */
+void writeColumns(const std::string &path, const mat &k, const Col<sword> &index, const mat &data);
+
+//Strips a trailing "-text", "-binary" or "-both" from the command line
+int outputFormatArg(int &argc, char *argv[]);
+
+#endif /* resultWriter_hpp */
@@ -0,0 +1,18 @@
+//
+//  shiftInvert.hpp
+//
+//
+//  Interior eigenpairs of large sparse Hamiltonians.
+//
+//
+
+#ifndef shiftInvert_hpp
+#define shiftInvert_hpp
+
+#include "tb_help.hpp"
+
+cx_vec minres(const sp_cx_mat &H, double sigma, const cx_vec &b, double tol, int maxIter);
+cx_mat startBlock(int n, int nev, unsigned seed);
+vec eigsNear(const sp_cx_mat &H, int nev, double sigma, cx_mat &X, cx_mat *eigvec = NULL, double tol = 1e-10);
+
+#endif /* shiftInvert_hpp */
@@ -0,0 +1,76 @@
+//
+//  subspaceSolver.hpp
+//  
+//
+//  Continuation eigensolver for Hamiltonians sampled at neighbouring k-points.
+//
+//
+
+#ifndef subspaceSolver_hpp
+#define subspaceSolver_hpp
+
+#include "tb_help.hpp"
+
+/*
+ * Follows a block of eigenpairs of a slowly varying Hermitian matrix. The
+ * eigenvectors from the previous call seed a Rayleigh-Ritz step, refined by a
+ * few block Davidson-style expansions with the residuals; if that does not
+ * converge the block is recomputed densely. Either a fixed band index range
+ * or an energy window can be tracked; a few guard bands on each side of the
+ * block keep neighbouring bands from slipping into it.
+ *
+ * In mixed precision mode the dense (re)starts are done in single precision
+ * and the block is then refined against the double precision matrix by the
+ * same Rayleigh-Ritz iteration, so the results keep full accuracy.
+ *
+ * A converged block is an invariant subspace, but not necessarily the one
+ * with the wanted band indices: a band from outside the guards can cross in
+ * between two points. So the block is reseeded when a guard Ritz value comes
+ * within margin of a wanted edge, and every checkInterval tracked solves the
+ * result is compared against a dense partial solve (eigRange / eigWindow).
+ * indexFailures() counts the spot checks that caught a wrong block.
+ */
+class SubspaceSolver
+{
+
+private:
+  bool    byWindow,   //track an energy window instead of an index range
+          warm,       //X holds eigenvectors of the previous matrix
+          mixed;      //dense starts in single precision
+  int     first,      //wanted band indices (index mode)
+          last,
+          lo,         //tracked block including guard bands
+          hi,
+          guard,
+          maxIter,
+          checkInterval,  //tracked solves between dense spot checks, 0 for none
+          sinceCheck,
+          failures,
+          found;      //band index of the first value the last solve returned
+  double  eMin,
+          eMax,
+          tol,
+          margin;     //closest a guard Ritz value may come to a wanted edge (eV)
+  cx_mat  X;
+  
+  vec seed(const cx_mat &H, bool single);
+  vec track(const cx_mat &H);
+  bool encloses(const vec &block, int n) const;
+  bool crowded(const vec &block) const;
+  bool sameBands(const cx_mat &H, const vec &block) const;
+  void init();
+  
+public:
+  SubspaceSolver();
+  SubspaceSolver(int firstBand, int lastBand);
+  SubspaceSolver(double windowMin, double windowMax);
+  
+  vec solve(const cx_mat &H);
+  void reset();
+  void setMixedPrecision(bool on);
+  void setIndexCheck(int interval, double edgeMargin = 1e-4);
+  int indexFailures() const;
+  int firstIndex() const;
+};
+
+#endif /* subspaceSolver_hpp */
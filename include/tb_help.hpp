@@ -23,16 +23,23 @@ std::vector<std::string> split(const std::string &s, char delim);
 bool isDouble(const std::string& s);
 std::complex<double> myRound(std::complex<double> x, double n = .0005);
 cx_double cexp(double x);
+void cexp(const double *x, cx_double *out, uword n);
 mat mergeSort(mat m);
+umat symmetricIndices(int dim, int order);
+int symIndex(int a, int b, int dim);
 int factorial(int n);
 mat buildSimplex(vec v, double r);
 double simplexSize(mat m);
 vec f_min(double (*f)(vec), mat x, int n);
 field<vec> grid(mat vertices, int ld);
-mat recipLat(mat lat);
-vec changeBasis(mat A, mat y);
-vec changeBasis(mat A, mat B, mat y);
+mat recipLat(const mat &lat);
+vec changeBasis(const mat &A, const mat &y);
+vec changeBasis(const mat &A, const mat &B, const mat &y);
 cx_mat downFold(cx_mat H, int val, int cond);
+vec eigRange(const cx_mat &H, int il, int iu, cx_mat *eigvec = NULL);
+fvec eigRange(const cx_fmat &H, int il, int iu, cx_fmat *eigvec = NULL);
+vec eigWindow(const cx_mat &H, double vl, double vu, cx_mat *eigvec = NULL);
+fvec eigWindow(const cx_fmat &H, float vl, float vu, cx_fmat *eigvec = NULL);
 void printMat(mat x);
 void print_cx_mat(cx_mat x);
 vec gradient(double (*f)(vec), vec k, double h = .00001);
@@ -10,8 +10,45 @@
 #define TightBinding_hpp
 
 #include "dataInput.hpp"
+#include "subspaceSolver.hpp"
+#include "parallel.hpp"
+#include "fixedKernels.hpp"
+#include "shiftInvert.hpp"
+#include "resultWriter.hpp"
+#include "response.hpp"
 #include <time.h>
+#include <map>
+#include <future>
+#include <memory>
 
+/*
+ * Load-time truncation of the hopping table. The defaults reproduce the
+ * original behaviour: drop |t| < .0005 and round the rest to that step.
+ */
+struct HoppingCutoff
+{
+  double  element,  //hoppings with |t| <= element are dropped
+          block;    //then R-blocks with sqrt(||T(R)||_1 ||T(R)||_inf) <= block
+  bool    round;    //round kept hoppings to multiples of element
+  
+  HoppingCutoff(double elementTol = .0005, double blockTol = 0, bool rounding = true)
+  : element(elementTol), block(blockTol), round(rounding) {}
+};
+
+//Work space for Ham, one per calling thread
+struct HamScratch
+{
+  vec     kR;
+  cx_vec  phase,
+          conjPhase,
+          packed;
+};
+
+/*
+ * All calculation methods are const and keep no state between calls, so one
+ * loaded model can be queried from many threads at once. Per-call buffers are
+ * either passed in (HamScratch) or thread-local.
+ */
 class TightBinding
 {
     
@@ -19,35 +56,113 @@ private:
   std::string seedname;
   Lattice     lat;
   mat         hr_dat,
-              hr_weights,
-              wsvec_dat,
-              wsvec_weights;
-  int         hamSize; //Dimension of Hamiltonian matrix;
+              hr_weights;
+  WsVecs      wsvec;
+  HoppingCutoff cutoff;
+  int         keptTerms,  //hr_dat rows kept by the cutoff, of totalTerms
+              totalTerms,
+              totalBlocks; //lattice vectors before block pruning
+  double      truncBound;  //sum_R ||T(R) - T_exact(R)||_2, bounds the eigenvalue error
+  int         hamSize, //Dimension of Hamiltonian matrix;
+              numThreads,
+              phaseReseed, //exact phases every this many k-path points
+              outputFormat; //textOutput and/or binaryOutput
+  
+  //Hopping table compiled from hr_dat/wsvec at construction:
+  //one weighted hamSize x hamSize block per unique lattice vector R.
+  imat        hop_cells;  //R in lattice coordinates, one column per block
+  mat         hop_R;      //R in cartesian coordinates, one row per block (x, y, z columns)
+  cx_cube     hop_blocks; //rounded hoppings with ws and degeneracy weights folded in
+  std::shared_ptr<MappedFile> cacheMap; //loaded cache; hop_cells, hop_blocks and wsvec are read-only views into it
+  
+  //Hermitian half of the same table: each R paired with -R, upper triangles only
+  bool        halfFill;   //build H from the half table (default)
+  uvec        upper_ind;  //column-major indices of the upper triangle
+  mat         half_R;     //one R of each (R, -R) pair, one row per pair
+  cx_mat      half_upper, //upper triangle of T(R), one column per pair
+              half_lower; //upper triangle of T(-R), one column per pair
+  cx_fmat     half_upper_f, //single precision copies for HamBatchSingle
+              half_lower_f;
+  bool        mixedPrecision;
+  bool        gapTracking; //plotGap follows the bands along each tile instead of exact solves
+  
+  //Sparse table for large models (sparse mode replaces the dense tables)
+  bool        sparse;
+  double      sparseTarget; //energy the shift-invert solver centres on
+  int         sparseBands;  //eigenpairs it returns
+  umat        sp_locations; //(row, col) of every nonzero of H(k), column-major order
+  uvec        sp_pos,       //nonzero each hopping adds to
+              sp_cell;      //lattice vector (column of hop_cells) of each hopping
+  cx_vec      sp_vals;
+  
+  //Compile-time sized kernels on the half table when (latDim, hamSize) has one
+  FixedHamKernel  fixedHamFn;
+  FixedGapKernel  fixedGapFn;
+  
+  void compileHoppings();
+  void compileHermitian();
+  void compileSparse();
+  void reportTable() const;
+  bool loadCache();
+  void writeCache() const;
+  template<typename eT>
+  void fillHermitian(const eT *packed, Mat<eT> &H) const;
+  cx_vec phases(const vec &k) const;
+  void pathPhases(const vec &k0, const vec &dk, int count, cx_double *out) const;
+  cx_cube HamFromPhases(const cx_mat &phase) const;
+  double gapFromHam(const cx_mat &H) const;
+  double screenGap(const cx_fmat &Hf, const vec &k) const;
     
 public:
   TightBinding();
-  TightBinding(std::string seed);
-  TightBinding(TightBinding &other);
+  TightBinding(std::string seed, HoppingCutoff cut = HoppingCutoff(), bool sparseTable = false);
+  TightBinding(const TightBinding &other);
     
   //Methods that access Lattice
-  mat latVecs();
-  mat kVecs();
-  cube kPoints();
-  std::vector<std::string> kPt_names_from();
-  std::vector<std::string> kPt_names_to();
+  const mat& latVecs() const;
+  const mat& kVecs() const;
+  const cube& kPoints() const;
+  const std::vector<std::string>& kPt_names_from() const;
+  const std::vector<std::string>& kPt_names_to() const;
+  
+  //Compiled hopping table
+  const imat& hoppingCells() const;
+  const cx_cube& hoppingBlocks() const;
+  double truncationError() const;
+    
+  void setHermitianFill(bool on);
+  void setMixedPrecision(bool on);
+  void setGapTracking(bool on);
+  void setFixedKernels(bool on);
+  void setThreads(int n);
+  void setSparseTarget(double target, int n = 8);
+  void setPhaseReseed(int n);
+  void setOutputFormat(int format);
     
   //Calculations
-  cx_mat Ham(vec k);
-  cx_cube expandHam_order1(vec k);
-  cx_cube expandHam_order2(vec k);
+  cx_mat Ham(const vec &k) const;
+  void Ham(const vec &k, cx_mat &H, HamScratch &scratch) const;
+  sp_cx_mat HamSparse(const vec &k) const;
+  cx_cube HamBatch(const mat &kpts) const;
+  cx_fcube HamBatchSingle(const mat &kpts) const;
+  cx_cube HamPath(const vec &k0, const vec &dk, int count) const;
+  std::vector<cx_cube> HamDerivatives(const vec &k, int order) const;
+  void HamDerivatives(const vec &k, int order, std::vector<cx_cube> &out, HamScratch &scratch) const;
+  cx_cube expandHam_order1(const vec &k) const;
+  cx_cube expandHam_order2(const vec &k) const;
   //cx_cube expandHam(vec k);
-  int computeBands(); 
-  double bandGap(vec k);
-  vec locateWeylNodes(vec k);
-  cx_mat fermiVelocity(vec k);
-  vec injectionCurrent(double omega, vec A, double T = 0);
-  cx_vec shiftCurrent(double omega, vec A, double T = 0);
-  int plotGap(int h, int k, int l);
+  int computeBands(double eMin = -datum::inf, double eMax = datum::inf) const;
+  double bandGap(const vec &k) const;
+  vec locateWeylNodes(const vec &k) const;
+  cx_mat fermiVelocity(const vec &k) const;
+  void positionDerivative(const vec &k, cx_cube &r, cx_cube &r_k) const;
+  vec injectionCurrent(double omega, vec A, double T = 0) const;
+  cx_vec shiftCurrent(double omega, vec A, double T = 0) const;
+  mat injectionSpectrum(const vec &omegas, const vec &A, double T = 0) const;
+  cx_mat shiftSpectrum(const vec &omegas, const vec &A, double T = 0) const;
+  ResponseTensor injectionTensor(const vec &omegas, double T = 0) const;
+  ResponseTensor shiftTensor(const vec &omegas, double T = 0) const;
+  int plotGap(int h, int k, int l, int res = 200) const;
   };
 
 #endif /* TightBinding_hpp */
@@ -7,115 +7,242 @@
 //
 
 #include "../include/dataInput.hpp"
+#include <charconv>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/***************************** Memory map ******************************/
+MappedFile::MappedFile(const std::string &path)
+{
+  int         fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  
+  if(fd < 0 || fstat(fd, &st) != 0)
+  {
+    if(fd >= 0)
+    {
+      close(fd);
+    }
+    throw "The file you are trying to access cannot be found or opened. (\'\')";
+  }
+  length = st.st_size;
+  data = NULL;
+  if(length > 0)
+  {
+    void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+      close(fd);
+      throw "The file you are trying to access could not be mapped into memory.";
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+    data = static_cast<const char *>(map);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if(data)
+  {
+    munmap(const_cast<char *>(data), length);
+  }
+}
+
+const char*
+MappedFile::begin() const
+{
+  return data;
+}
+
+const char*
+MappedFile::end() const
+{
+  return data + length;
+}
+
+size_t
+MappedFile::size() const
+{
+  return length;
+}
+
+/***************************** Number parsing ******************************/
+static inline const char*
+skipBlanks(const char *p, const char *end)
+{
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+  {
+    p++;
+  }
+  return p;
+}
+
+static inline const char*
+nextLine(const char *p, const char *end)
+{
+  while(p < end && *p != '\n')
+  {
+    p++;
+  }
+  return p < end ? p + 1 : end;
+}
+
+//Parses the next integer or double after any whitespace
+template<typename T>
+static inline const char*
+parseNumber(const char *p, const char *end, T &x)
+{
+  p = skipBlanks(p, end);
+  std::from_chars_result res = std::from_chars(p, end, x);
+  if(res.ec != std::errc())
+  {
+    throw "Error in input file '_hr.dat': expected a number.";
+  }
+  return res.ptr;
+}
 
 /***************************** Data Input ******************************/
+
+/*
+ * The _hr.dat file is mapped into memory and parsed in a single pass: the
+ * header (comment line, number of bands, number of R-vectors and their
+ * degeneracies) is read once, the table is allocated for its
+ * numSites * numBands^2 rows up front, and the columns (R, m, n, Re, Im) are
+ * converted with std::from_chars.
+ */
 std::vector<mat>
 read_hrFile(std::string seedname)
 {
-  int           currentRow = 0,
-                currentCol,
-                numCols = 0,
+  int           numCols = 0,
                 numBands = 0,
-                numSites = 0;
+                numSites = 0,
+                numRows;
   double        x;
-  std::string 	inputLine,
-                path = "../data/" + seedname + "_hr.dat";
+  std::string   path = "../data/" + seedname + "_hr.dat";
   mat           data;
   vec           weights;
-  std::ifstream inputStream(path);
 
   std::cout << "Attempting to read data from \'" << path << "\'\n" << "...\n" << std::endl;
-    
-  if(inputStream.fail())
-  {
-    throw "The file you are trying to access cannot be found or opened. (\'\')";
-  }
-  while(inputStream.good())
+  
   {
-    getline(inputStream, inputLine);
-    inputStream >> numBands;
-    inputStream >> numSites;
-    weights.resize(numSites);
-    data.resize(numSites * numBands * numBands, 0);
-    int index = 0;
+    MappedFile  file(path);
+    const char  *p = file.begin(),
+                *end = file.end(),
+                *line;
     
-    while(getline(inputStream, inputLine) && index < numSites - 1)
+    p = nextLine(p, end);   //date line
+    p = parseNumber(p, end, numBands);
+    p = parseNumber(p, end, numSites);
+    weights.set_size(numSites);
+    for(int i = 0; i < numSites; i++)
     {
-      while(index < numSites && inputStream >> x)
-      {
-        weights(index++) = x;
-      }
+      p = parseNumber(p, end, x);
+      weights(i) = x;
     }
-          
-    while(getline(inputStream, inputLine))
+    
+    //the first row tells the number of columns (lattice dimension + 4)
+    p = nextLine(p, end);
+    p = skipBlanks(p, end);
+    for(line = p; line < end && *line != '\n'; )
     {
-      std::istringstream ss(inputLine);
-      currentCol = 0;
-      while(ss >> x)
+      while(line < end && (*line == ' ' || *line == '\t' || *line == '\r'))
       {
-        if (currentCol >= data.n_cols)
-        {
-          data.resize(numBands * numBands * numSites, numCols + 1);
-        }
-        data(currentRow, currentCol++) = x;
-        if (currentCol >= numCols)
+        line++;
+      }
+      if(line < end && *line != '\n')
+      {
+        numCols++;
+        while(line < end && *line != ' ' && *line != '\t' && *line != '\r' && *line != '\n')
         {
-          numCols = currentCol;
+          line++;
         }
       }
-      currentRow++;
     }
-  }
-    
-  //Reading _wsvec file
-    
-  int     length = numBands * numBands * numSites,
-          wslength = 0;
-  mat     wsweights(length, 1),
-          wsvec(length * 10, 3);
-  path = "../data/" + seedname + "_wsvec.dat";
-    
-  std::cout << "Attempting to read data from \'" << path << "\'\n" << "...\n" << std::endl;
     
-  inputStream.close();
-  inputStream.open(path);
-  getline(inputStream, inputLine);
-
-  for(int i = 0; i < length; i++)
-  {
-    getline(inputStream, inputLine);
-    getline(inputStream, inputLine);
-    std::istringstream ss(inputLine);
-    ss >> x;
-    wslength += x;
-    if (wsvec.n_rows < wslength)
+    numRows = numSites * numBands * numBands;
+    data.set_size(numRows, numCols);
+    for(int row = 0; row < numRows; row++)
     {
-      wsvec.resize(wslength, 3);
+      for(int col = 0; col < numCols; col++)
+      {
+        p = parseNumber(p, end, x);
+        data(row, col) = x;
+      }
     }
-    wsweights(i, 0) = x;
-    for(int j = 0; j < x; j++)
+  }
+  
+  std::vector<mat> rdata(2);
+  rdata[0] = data;
+  rdata[1] = weights;
+  return rdata;
+}
+
+/*
+ * Streams through _wsvec.dat: after the comment line, every entry is a line
+ * "R m n", a line with the number of images, and that many lines of integer
+ * shifts. The shifts are kept as 16-bit integers, one column per image, with
+ * a prefix sum of the image counts locating each entry's images, so nothing
+ * has to be guessed or resized. Independent of read_hrFile, so both can run
+ * at the same time.
+ */
+WsVecs
+read_wsvecFile(std::string seedname)
+{
+  std::string           path = "../data/" + seedname + "_wsvec.dat";
+  std::vector<s16>      shifts;
+  std::vector<uword>    offsets(1, 0);
+  int                   dim = 0,
+                        count,
+                        x;
+  WsVecs                rVal;
+  
+  std::cout << "Attempting to read data from \'" << path << "\'\n" << "...\n" << std::endl;
+  
+  MappedFile  file(path);
+  const char  *p = nextLine(file.begin(), file.end()),
+              *end = file.end(),
+              *line;
+  
+  shifts.reserve(file.size() / 8);
+  while((p = skipBlanks(p, end)) < end)
+  {
+    p = nextLine(p, end);   //R m n
+    p = parseNumber(p, end, count);
+    p = nextLine(p, end);
+    if(count > 0 && dim == 0)
     {
-      getline(inputStream, inputLine);
-      std::istringstream iss(inputLine);
-      int tmp, k = 0;
-      while(iss >> tmp)
+      //number of components from the first image line
+      for(line = skipBlanks(p, end); line < end && *line != '\n'; )
       {
-        wsvec(wslength - x + j, k++) = tmp;
+        dim++;
+        while(line < end && *line != ' ' && *line != '\t' && *line != '\r' && *line != '\n')
+        {
+          line++;
+        }
+        while(line < end && (*line == ' ' || *line == '\t' || *line == '\r'))
+        {
+          line++;
+        }
       }
     }
-    if(!(i % 50000))
+    for(int j = 0; j < count * dim; j++)
     {
-      //std::cout << i << " out of " << length << std::endl;
+      p = parseNumber(p, end, x);
+      if(x < -32768 || x > 32767)
+      {
+        throw "Error in input file '_wsvec.dat': lattice shift out of range.";
+      }
+      shifts.push_back((s16)x);
     }
+    offsets.push_back(offsets.back() + count);
   }
-  wsvec.resize(wslength, 3);
   
-  std::vector<mat> rdata(4);
-  rdata[0] = data;
-  rdata[1] = weights;
-  rdata[2] = wsvec;
-  rdata[3] = wsweights;
-  return rdata;
+  rVal.shifts = Mat<s16>(shifts.data(), dim, offsets.back());
+  rVal.offsets = uvec(offsets);
+  return rVal;
 }
 
 /***************************** Reading .win file *****************************/
@@ -0,0 +1,206 @@
+//
+//  hamMesh.cpp
+//
+//
+//  H(k) on a uniform Brillouin-zone mesh by FFT of the hopping table.
+//
+//
+
+#include "../include/hamMesh.hpp"
+
+#define meshBudget ((double)(8ULL << 30))  //bytes the mesh tables may take
+
+static inline int
+wrap(int c, int n)
+{
+  return ((c % n) + n) % n;
+}
+
+HamMesh::HamMesh(const TightBinding &tb, int m1, int m2, int m3, int order)
+{
+  const imat    &cells = tb.hoppingCells();
+  const cx_cube &blocks = tb.hoppingBlocks();
+  int           dim = cells.n_rows,
+                numPairs,
+                numPlane;
+
+  if(dim != 2 && dim != 3)
+  {
+    throw "HamMesh: lattice must be of dimension 2 or 3";
+  }
+  if(blocks.is_empty())
+  {
+    throw "HamMesh: needs the dense hopping table (not available in sparse mode)";
+  }
+  if(m1 < 1 || m2 < 1 || (dim == 3 && m3 < 1))
+  {
+    throw "HamMesh: mesh dimensions must be positive";
+  }
+  if(order != 0 && order != 1)
+  {
+    throw "HamMesh: only H (order 0) and dH/dk (order 1) are available";
+  }
+
+  hamSize = blocks.n_rows;
+  n1 = m1;
+  n2 = m2;
+  n3 = (dim == 3) ? m3 : 1;
+  kVecs = tb.kVecs();
+  numPairs = hamSize * hamSize;
+  numTerms = numPairs * (1 + order * dim);
+  numPlane = n2 * n3;
+  mat   R = tb.latVecs() * conv_to<mat>::from(cells);   //cartesian R, one column per block
+
+  //group the blocks by R_1 mod n1
+  std::map<int, std::vector<int> >  groups;
+  for(int r = 0; r < (int)cells.n_cols; r++)
+  {
+    groups[wrap(cells(0, r), n1)].push_back(r);
+  }
+
+  //planes, the slab and the transform grid, all numTerms x (n2 n3)
+  double  bytes = (double)numTerms * numPlane * (groups.size() + 2) * sizeof(cx_double);
+  if(bytes > meshBudget)
+  {
+    std::stringstream msg;
+    msg << "HamMesh: a " << n1 << " x " << n2 << " x " << n3 << " mesh with " << hamSize << " bands"
+        << (order ? " and dH/dk" : "") << " needs " << bytes / (1 << 30) << " GB for its tables, over the "
+        << meshBudget / (1 << 30) << " GB budget; use fewer points along the 2nd and 3rd axes";
+    throw msg.str();
+  }
+  residues.set_size(groups.size());
+  planes.zeros(numTerms, numPlane, groups.size());
+
+  cx_cube grid(n2, n3, numTerms);
+  int     q = 0;
+  for(std::map<int, std::vector<int> >::const_iterator it = groups.begin(); it != groups.end(); ++it, q++)
+  {
+    residues(q) = it->first;
+    grid.zeros();
+    for(size_t g = 0; g < it->second.size(); g++)
+    {
+      int               r = it->second[g],
+                        a = wrap(cells(1, r), n2),
+                        b = (dim == 3) ? wrap(cells(2, r), n3) : 0;
+      const cx_double   *T = blocks.slice_memptr(r);
+      for(int p = 0; p < numPairs; p++)
+      {
+        grid(a, b, p) += T[p];
+      }
+      //dH/dk_a = sum_R i R_a T(R) exp(ik.R)
+      for(int c = 1; c < numTerms / numPairs; c++)
+      {
+        cx_double iR(0, R(c - 1, r));
+        for(int p = 0; p < numPairs; p++)
+        {
+          grid(a, b, c * numPairs + p) += iR * T[p];
+        }
+      }
+    }
+
+    //unnormalised inverse transform: sum_R T(R) exp(+2 pi i k.R)
+    cx_mat  &plane = planes.slice(q);
+    for(int p = 0; p < numTerms; p++)
+    {
+      cx_mat  Hp = ifft2(grid.slice(p)) * (double)numPlane;
+      for(int j = 0; j < numPlane; j++)
+      {
+        plane(p, j) = Hp(j);
+      }
+    }
+  }
+
+  Hk.set_size(hamSize, hamSize);
+  dHk.set_size(hamSize, hamSize, order * dim);
+  restart();
+}
+
+//Back to before the first point
+void
+HamMesh::restart()
+{
+  slab = -1;
+  point = n2 * n3 - 1;
+}
+
+int
+HamMesh::size() const
+{
+  return n1 * n2 * n3;
+}
+
+//Combines the residue planes into H for every point with this i1
+void
+HamMesh::computeSlab()
+{
+  cx_vec  w(residues.n_elem);
+  for(uword q = 0; q < residues.n_elem; q++)
+  {
+    w(q) = std::polar(1., 2 * datum::pi * slab * residues(q) / n1);
+  }
+
+  cx_mat  flat(planes.memptr(), planes.n_rows * planes.n_cols, planes.n_slices, false, true);
+  cx_vec  sum = flat * w;
+  slabH = reshape(sum, planes.n_rows, planes.n_cols);
+}
+
+//Advances to the next mesh point; false once the mesh is exhausted
+bool
+HamMesh::next()
+{
+  if(++point == n2 * n3)
+  {
+    if(++slab == n1)
+    {
+      point--;
+      slab--;
+      return false;
+    }
+    computeSlab();
+    point = 0;
+  }
+  std::copy(slabH.colptr(point), slabH.colptr(point) + hamSize * hamSize, Hk.memptr());
+  std::copy(slabH.colptr(point) + hamSize * hamSize, slabH.colptr(point) + numTerms, dHk.memptr());
+  return true;
+}
+
+const cx_mat&
+HamMesh::H() const
+{
+  return Hk;
+}
+
+//dH/dk_a (cartesian) at the current point, slice a; empty unless order 1
+const cx_cube&
+HamMesh::dH() const
+{
+  return dHk;
+}
+
+//Mesh indices (i1, i2, i3) of the current point
+ivec
+HamMesh::index() const
+{
+  ivec  ind(kVecs.n_cols);
+  ind(0) = slab;
+  ind(1) = point % n2;
+  if(ind.n_elem > 2)
+  {
+    ind(2) = point / n2;
+  }
+  return ind;
+}
+
+//Current point in cartesian coordinates
+vec
+HamMesh::k() const
+{
+  vec   frac(kVecs.n_cols);
+  ivec  ind = index();
+  int   n[3] = {n1, n2, n3};
+  for(uword i = 0; i < frac.n_elem; i++)
+  {
+    frac(i) = (double)ind(i) / n[i];
+  }
+  return kVecs * frac;
+}
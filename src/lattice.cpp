@@ -10,7 +10,7 @@
 
 Lattice::Lattice(){}
 
-Lattice::Lattice(mat &lat, cube &ks, std::vector<std::string> &kFrom, std::vector<std::string> &kTo)
+Lattice::Lattice(const mat &lat, const cube &ks, const std::vector<std::string> &kFrom, const std::vector<std::string> &kTo)
 {
   latticeVecs = lat;
   kVecs = recipLat(lat);
@@ -30,40 +30,40 @@ Lattice::Lattice(const Lattice &other)
 }
 
 
-mat
-Lattice::latticeVectors()
+const mat&
+Lattice::latticeVectors() const
 {
   return latticeVecs;
 }
 
-mat
-Lattice::kVectors()
+const mat&
+Lattice::kVectors() const
 {
   return kVecs;
 }
 
-cube
-Lattice::kPoints()
+const cube&
+Lattice::kPoints() const
 {
   return kPts;
 }
 
-std::vector<std::string>
-Lattice::kPt_names_from()
+const std::vector<std::string>&
+Lattice::kPt_names_from() const
 {
   return kPtsFrom;
 }
 
-std::vector<std::string>
-Lattice::kPt_names_to()
+const std::vector<std::string>&
+Lattice::kPt_names_to() const
 {
   return kPtsTo;
 }
 
 unsigned
-Lattice::dim()
+Lattice::dim() const
 {
-  return (unsigned)latticeVectors().n_cols;
+  return (unsigned)latticeVecs.n_cols;
 }
 
 
@@ -0,0 +1,353 @@
+//
+//  modelCache.cpp
+//
+//
+//  Binary cache of a compiled TightBinding model.
+//
+//
+
+#include "../include/tightBinding.hpp"
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Layout of "<seedname>_tb.cache", every field padded to a multiple of 8
+ * bytes so arrays can be used straight from the mapping:
+ *
+ *   "TBCACHE", version, payload length, payload hash
+ *   --- payload, everything below ---
+ *   size, mtime and hash of .win, _hr.dat, _wsvec.dat
+ *   cutoff (element, block, round)
+ *   latDim, hamSize, number of R-blocks, k-path points, ws components,
+ *   ws images, ws entries
+ *   lattice vectors, k-path cube, k-point names
+ *   hop_cells, hop_blocks, truncation bound
+ *   kept and total hoppings, lattice vectors before pruning
+ *   ws shifts, ws offsets
+ *
+ * The cache is only used if the payload has the stored length and hash and
+ * all source keys and the cutoff match; anything else (including a newer
+ * version number) falls back to parsing.
+ */
+#define cacheVersion 3
+#define headerSize 32
+
+//FNV-1a over 8-byte words, then the tail bytes
+static uint64_t
+hashBytes(const char *p, size_t n)
+{
+  size_t      i = 0;
+  uint64_t    h = 14695981039346656037ULL,
+              w;
+
+  for(; i + 8 <= n; i += 8)
+  {
+    std::memcpy(&w, p + i, 8);
+    h = (h ^ w) * 1099511628211ULL;
+  }
+  for(; i < n; i++)
+  {
+    h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+struct SourceKey
+{
+  uint64_t  size;
+  int64_t   mtime;
+  uint64_t  hash;
+};
+
+static uint64_t
+hashFile(const std::string &path)
+{
+  MappedFile  file(path);
+  return hashBytes(file.begin(), file.size());
+}
+
+//Rebuilds x as a strict view of read-only mapped memory; it must never be written
+template<typename T, typename... Dims>
+static void
+mapInto(T &x, const void *p, Dims... dims)
+{
+  typedef typename T::elem_type eT;
+  x.~T();
+  new (&x) T(const_cast<eT *>(static_cast<const eT *>(p)), dims..., false, true);
+}
+
+//Size and mtime from stat, the hash only when asked (it reads the file)
+static bool
+sourceKey(const std::string &path, bool withHash, SourceKey &key)
+{
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0)
+  {
+    return false;
+  }
+  key.size = st.st_size;
+  key.mtime = st.st_mtime;
+  key.hash = withHash ? hashFile(path) : 0;
+  return true;
+}
+
+static std::vector<std::string>
+sourcePaths(const std::string &seedname)
+{
+  std::string               base = "../data/" + seedname;
+  std::vector<std::string>  paths;
+  paths.push_back(base + ".win");
+  paths.push_back(base + "_hr.dat");
+  paths.push_back(base + "_wsvec.dat");
+  return paths;
+}
+
+static void
+put(std::string &buf, const void *p, size_t n)
+{
+  buf.append(static_cast<const char *>(p), n);
+  buf.append((8 - n % 8) % 8, '\0');
+}
+
+template<typename T>
+static void
+putValue(std::string &buf, T x)
+{
+  put(buf, &x, sizeof(T));
+}
+
+//Sequential reader over the mapped cache
+class CacheReader
+{
+
+private:
+  const char  *p,
+              *end;
+
+public:
+  CacheReader(const char *begin, const char *stop) : p(begin), end(stop) {}
+
+  const char* take(size_t n)
+  {
+    size_t  padded = n + (8 - n % 8) % 8;
+    if(p + padded > end)
+    {
+      throw "model cache is truncated";
+    }
+    const char *rVal = p;
+    p += padded;
+    return rVal;
+  }
+
+  template<typename T>
+  T value()
+  {
+    T x;
+    std::memcpy(&x, take(sizeof(T)), sizeof(T));
+    return x;
+  }
+};
+
+/*
+ * Writes the compiled model next to its sources. Every writer gets its own
+ * temporary file (mkstemp) which is renamed into place once complete, so
+ * concurrent jobs never write into each other's file; the payload hash
+ * additionally rejects anything that is not a complete cache. Failure to
+ * write is not an error, the next run simply parses again.
+ */
+void
+TightBinding::writeCache() const
+{
+  std::vector<std::string>  paths = sourcePaths(seedname);
+  std::string               buf,
+                            head,
+                            path = "../data/" + seedname + "_tb.cache";
+  std::vector<char>         tmpPath(path.begin(), path.end());
+  const mat                 &latticeVecs = latVecs();
+  const cube                &kPts = kPoints();
+  const std::vector<std::string>  &from = kPt_names_from(),
+                                  &to = kPt_names_to();
+  SourceKey                 key;
+
+  for(size_t i = 0; i < paths.size(); i++)
+  {
+    if(!sourceKey(paths[i], true, key))
+    {
+      return;
+    }
+    putValue(buf, key);
+  }
+  putValue(buf, cutoff.element);
+  putValue(buf, cutoff.block);
+  putValue<uint64_t>(buf, cutoff.round);
+
+  putValue<uint64_t>(buf, lat.dim());
+  putValue<uint64_t>(buf, hamSize);
+  putValue<uint64_t>(buf, hop_blocks.n_slices);
+  putValue<uint64_t>(buf, kPts.n_cols);
+  putValue<uint64_t>(buf, wsvec.shifts.n_rows);
+  putValue<uint64_t>(buf, wsvec.shifts.n_cols);
+  putValue<uint64_t>(buf, wsvec.offsets.n_elem);
+
+  put(buf, latticeVecs.memptr(), latticeVecs.n_elem * sizeof(double));
+  put(buf, kPts.memptr(), kPts.n_elem * sizeof(double));
+  for(size_t i = 0; i < from.size(); i++)
+  {
+    putValue<uint64_t>(buf, from[i].size());
+    put(buf, from[i].data(), from[i].size());
+    putValue<uint64_t>(buf, to[i].size());
+    put(buf, to[i].data(), to[i].size());
+  }
+
+  put(buf, hop_cells.memptr(), hop_cells.n_elem * sizeof(sword));
+  put(buf, hop_blocks.memptr(), hop_blocks.n_elem * sizeof(cx_double));
+  putValue(buf, truncBound);
+  putValue<uint64_t>(buf, keptTerms);
+  putValue<uint64_t>(buf, totalTerms);
+  putValue<uint64_t>(buf, totalBlocks);
+  put(buf, wsvec.shifts.memptr(), wsvec.shifts.n_elem * sizeof(s16));
+  put(buf, wsvec.offsets.memptr(), wsvec.offsets.n_elem * sizeof(uword));
+
+  put(head, "TBCACHE", 8);
+  putValue<uint64_t>(head, cacheVersion);
+  putValue<uint64_t>(head, buf.size());
+  putValue<uint64_t>(head, hashBytes(buf.data(), buf.size()));
+
+  const char  suffix[] = ".XXXXXX";
+  tmpPath.insert(tmpPath.end(), suffix, suffix + sizeof(suffix));
+  int   fd = mkstemp(tmpPath.data());
+  if(fd < 0)
+  {
+    return;
+  }
+  fchmod(fd, 0644);   //mkstemp creates it private to the user
+  FILE  *out = fdopen(fd, "wb");
+  if(!out)
+  {
+    close(fd);
+    unlink(tmpPath.data());
+    return;
+  }
+  bool  ok = fwrite(head.data(), 1, head.size(), out) == head.size()
+             && fwrite(buf.data(), 1, buf.size(), out) == buf.size();
+  ok = (fclose(out) == 0) && ok;
+  //the temporary is ours alone, so removing it on failure cannot hit another job
+  if(!ok || rename(tmpPath.data(), path.c_str()) != 0)
+  {
+    unlink(tmpPath.data());
+    return;
+  }
+  std::cout << "Wrote model cache \'" << path << "\'\n" << std::endl;
+}
+
+/*
+ * Restores the lattice, k-path, compiled hopping table and ws data from the
+ * cache if it is complete and matches the current sources and cutoff. The
+ * file stays mapped read-only (cacheMap) and hop_cells, hop_blocks and the
+ * ws arrays are strict armadillo views of the mapping, so nothing large is
+ * copied; only the small lattice and k-path are. A source whose size and
+ * mtime match is trusted as is; one with the same size but a new mtime
+ * (e.g. copied or touched) is hashed and accepted if the contents agree.
+ * hr_dat is left empty, it is only needed to compile.
+ */
+bool
+TightBinding::loadCache()
+{
+  std::vector<std::string>  paths = sourcePaths(seedname);
+  std::string               path = "../data/" + seedname + "_tb.cache";
+  struct stat               st;
+  SourceKey                 key, stored[3];
+
+  if(stat(path.c_str(), &st) != 0)
+  {
+    return false;
+  }
+  try
+  {
+    std::shared_ptr<MappedFile> map(new MappedFile(path));
+    CacheReader   in(map->begin(), map->end());
+
+    if(std::memcmp(in.take(8), "TBCACHE", 8) != 0 || in.value<uint64_t>() != cacheVersion)
+    {
+      return false;
+    }
+    uint64_t      payloadSize = in.value<uint64_t>(),
+                  payloadHash = in.value<uint64_t>();
+    if(payloadSize != map->size() - headerSize
+       || hashBytes(map->begin() + headerSize, payloadSize) != payloadHash)
+    {
+      return false;
+    }
+    for(int i = 0; i < 3; i++)
+    {
+      stored[i] = in.value<SourceKey>();
+      if(!sourceKey(paths[i], false, key) || key.size != stored[i].size)
+      {
+        return false;
+      }
+      //only a changed mtime costs a read of the source
+      if(key.mtime != stored[i].mtime && hashFile(paths[i]) != stored[i].hash)
+      {
+        return false;
+      }
+    }
+    if(in.value<double>() != cutoff.element || in.value<double>() != cutoff.block
+       || in.value<uint64_t>() != (uint64_t)cutoff.round)
+    {
+      return false;
+    }
+
+    uword   latDim = in.value<uint64_t>(),
+            nBands = in.value<uint64_t>(),
+            nR = in.value<uint64_t>(),
+            nPts = in.value<uint64_t>(),
+            wsDim = in.value<uint64_t>(),
+            nImages = in.value<uint64_t>(),
+            nOffsets = in.value<uint64_t>();
+
+    mat     latticeVecs(reinterpret_cast<const double *>(in.take(latDim * latDim * sizeof(double))), latDim, latDim);
+    cube    kPts(reinterpret_cast<const double *>(in.take(latDim * nPts * 2 * sizeof(double))), latDim, nPts, 2);
+    std::vector<std::string>  from, to;
+    for(uword i = 0; i + 1 < nPts; i++)
+    {
+      uword len = in.value<uint64_t>();
+      from.push_back(std::string(in.take(len), len));
+      len = in.value<uint64_t>();
+      to.push_back(std::string(in.take(len), len));
+    }
+
+    const char      *cells = in.take(latDim * nR * sizeof(sword)),
+                    *blocks = in.take(nBands * nBands * nR * sizeof(cx_double));
+    double          bound = in.value<double>();
+    uword           kept = in.value<uint64_t>(),
+                    total = in.value<uint64_t>(),
+                    unpruned = in.value<uint64_t>();
+    const char      *shifts = in.take(wsDim * nImages * sizeof(s16)),
+                    *offsets = in.take(nOffsets * sizeof(uword));
+
+    lat = Lattice(latticeVecs, kPts, from, to);
+    hamSize = nBands;
+    mapInto(hop_cells, cells, latDim, nR);
+    hop_R = trans(latticeVecs * conv_to<mat>::from(hop_cells));
+    mapInto(hop_blocks, blocks, nBands, nBands, nR);
+    truncBound = bound;
+    keptTerms = kept;
+    totalTerms = total;
+    totalBlocks = unpruned;
+    mapInto(wsvec.shifts, shifts, wsDim, nImages);
+    mapInto(wsvec.offsets, offsets, nOffsets);
+    cacheMap = map;
+  }
+  catch(const char *)
+  {
+    return false;
+  }
+
+  std::cout << "Loaded compiled model from \'" << path << "\'" << std::endl;
+  reportTable();
+  return true;
+}
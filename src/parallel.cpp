@@ -0,0 +1,166 @@
+//
+//  parallel.cpp
+//  
+//
+//  Thread pool helpers for the k-point loops.
+//
+//
+
+#include "../include/parallel.hpp"
+
+//Number of hardware threads, at least 1
+int
+defaultThreads()
+{
+  int n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+/*
+ * Runs body(task, thread) for every task and returns when all are done.
+ * Each thread starts with a contiguous range of tasks in its own deque and
+ * takes work from the front; once empty it steals from the back of the
+ * fullest other deque. Suited to tasks of uneven cost.
+ */
+void
+stealingFor(int numTasks, int numThreads, std::function<void(int, int)> body)
+{
+  std::vector<std::deque<int> >   queues(numThreads);
+  std::vector<std::mutex>         locks(numThreads);
+  std::vector<std::thread>        workers;
+  std::vector<std::exception_ptr> errors(numThreads);
+  
+  for(int task = 0; task < numTasks; task++)
+  {
+    queues[(long)task * numThreads / numTasks].push_back(task);
+  }
+  
+  for(int t = 0; t < numThreads; t++)
+  {
+    workers.push_back(std::thread([&, t]()
+    {
+      while(true)
+      {
+        int task = -1;
+        {
+          std::lock_guard<std::mutex> guard(locks[t]);
+          if(!queues[t].empty())
+          {
+            task = queues[t].front();
+            queues[t].pop_front();
+          }
+        }
+        if(task < 0)
+        {
+          //steal from the victim with the most work left
+          int victim = -1;
+          size_t most = 0;
+          for(int v = 0; v < numThreads; v++)
+          {
+            std::lock_guard<std::mutex> guard(locks[v]);
+            if(v != t && queues[v].size() > most)
+            {
+              most = queues[v].size();
+              victim = v;
+            }
+          }
+          if(victim < 0)
+          {
+            return;
+          }
+          std::lock_guard<std::mutex> guard(locks[victim]);
+          if(queues[victim].empty())
+          {
+            continue;
+          }
+          task = queues[victim].back();
+          queues[victim].pop_back();
+        }
+        try
+        {
+          body(task, t);
+        }
+        catch(...)
+        {
+          errors[t] = std::current_exception();
+        }
+      }
+    }));
+  }
+  for(int t = 0; t < numThreads; t++)
+  {
+    workers[t].join();
+  }
+  for(int t = 0; t < numThreads; t++)
+  {
+    if(errors[t])
+    {
+      std::rethrow_exception(errors[t]);
+    }
+  }
+}
+
+TaskPool::TaskPool(int tasks, int threads, std::function<void(int, int)> f)
+{
+  numTasks = tasks;
+  body = f;
+  next = 0;
+  done.assign(tasks, 0);
+  errors.resize(tasks);
+  for(int t = 0; t < threads; t++)
+  {
+    workers.push_back(std::thread(&TaskPool::run, this, t));
+  }
+}
+
+TaskPool::~TaskPool()
+{
+  for(int t = 0; t < workers.size(); t++)
+  {
+    workers[t].join();
+  }
+}
+
+void
+TaskPool::run(int thread)
+{
+  for(int task = next++; task < numTasks; task = next++)
+  {
+    try
+    {
+      body(task, thread);
+    }
+    catch(...)
+    {
+      errors[task] = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done[task] = 1;
+    }
+    finished.notify_all();
+  }
+}
+
+void
+TaskPool::wait(int task)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while(!done[task])
+  {
+    finished.wait(guard);
+  }
+  if(errors[task])
+  {
+    std::rethrow_exception(errors[task]);
+  }
+}
+
+void
+TaskPool::waitAll()
+{
+  for(int task = 0; task < numTasks; task++)
+  {
+    wait(task);
+  }
+}
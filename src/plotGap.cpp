@@ -12,22 +12,48 @@
 int
 main(int argc, char* argv[])
 {
-  if(argc != 5)
+  int format = outputFormatArg(argc, argv);
+  if(argc < 5 || argc > 9)
   {
-    cerr << "routine plotGap: Imporoper number of command line arguements specified (4)" << std::endl;
+    cerr << "routine plotGap: Imporoper number of command line arguements specified (4 to 8)" << std::endl;
+    cerr << "usage: plotGap seedname h k l [resolution] [threads] [track] [mixed] [-text|-binary|-both]" << std::endl;
   }
   else{
     clock_t t = clock();
     std::string seedname = argv[1];
-    int         h, k, l;
+    int         h, k, l,
+                res = 200,
+                threads = defaultThreads(),
+                track = 0,
+                mixed = 0;
     sscanf(argv[2], "%d", &h);
     sscanf(argv[3], "%d", &k);
     sscanf(argv[4], "%d", &l);
+    if(argc > 5)
+    {
+      sscanf(argv[5], "%d", &res);
+    }
+    if(argc > 6)
+    {
+      sscanf(argv[6], "%d", &threads);
+    }
+    if(argc > 7)
+    {
+      sscanf(argv[7], "%d", &track);  //1: follow the bands instead of exact solves
+    }
+    if(argc > 8)
+    {
+      sscanf(argv[8], "%d", &mixed);  //1: single precision screening, small gaps refined
+    }
         
     TightBinding tb(seedname);
+    tb.setThreads(threads);
+    tb.setOutputFormat(format);
+    tb.setGapTracking(track != 0);
+    tb.setMixedPrecision(mixed != 0);
     try
     {
-      tb.plotGap(h, k, l);
+      tb.plotGap(h, k, l, res);
       std::cout << "Finished" << std::endl;
       t = clock() - t;
       int  time = t / CLOCKS_PER_SEC,
@@ -0,0 +1,84 @@
+//
+//  response.cpp
+//
+//
+//  Photocurrent response tensors on a frequency grid.
+//
+//
+
+#include "../include/response.hpp"
+
+ResponseTensor::ResponseTensor(){}
+
+ResponseTensor::ResponseTensor(const vec &frequencies, const cx_cube &tensor)
+: omegas(frequencies), chi(tensor)
+{
+  if(chi.n_slices != omegas.n_elem || chi.n_cols != chi.n_rows * chi.n_rows)
+  {
+    throw "ResponseTensor: tensor does not match the frequency grid";
+  }
+}
+
+int
+ResponseTensor::dim() const
+{
+  return chi.n_rows;
+}
+
+const vec&
+ResponseTensor::frequencies() const
+{
+  return omegas;
+}
+
+//chi(a, b, c) at the i-th frequency
+cx_cube
+ResponseTensor::tensor(uword i) const
+{
+  return cx_cube(chi.slice_memptr(i), dim(), dim(), dim());
+}
+
+/*
+ * j_a(omega) for the polarisation e, one column per frequency. The outer
+ * product e conj(e)^T is formed once; each frequency is then one
+ * dim x dim^2 slice times a vector.
+ */
+cx_mat
+ResponseTensor::current(const cx_vec &e) const
+{
+  if((int)e.n_elem != dim())
+  {
+    throw "ResponseTensor: polarisation has the wrong dimension";
+  }
+  cx_mat  outer = e * e.t();                //(b, c) -> e_b conj(e_c)
+  cx_vec  flat = vectorise(outer);          //b + dim c
+  cx_mat  rVal(dim(), chi.n_slices);
+
+  for(uword i = 0; i < chi.n_slices; i++)
+  {
+    rVal.col(i) = chi.slice(i) * flat;
+  }
+  return rVal;
+}
+
+//Real part of current(e), for tensors Hermitian in (b, c) the whole of it
+mat
+ResponseTensor::realCurrent(const cx_vec &e) const
+{
+  return real(current(e));
+}
+
+//cos(angle) u + sin(angle) v
+cx_vec
+ResponseTensor::linear(const vec &u, const vec &v, double angle)
+{
+  return conv_to<cx_vec>::from(std::cos(angle) * normalise(u) + std::sin(angle) * normalise(v));
+}
+
+//(u + i helicity v) / sqrt(2), u and v orthogonal to the direction of propagation
+cx_vec
+ResponseTensor::circular(const vec &u, const vec &v, int helicity)
+{
+  cx_vec  rVal(normalise(u), (helicity >= 0 ? 1. : -1.) * normalise(v));
+  return rVal / std::sqrt(2.);
+}
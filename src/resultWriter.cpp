@@ -0,0 +1,165 @@
+//
+//  resultWriter.cpp
+//
+//
+//  Buffered text and binary columnar output of k-resolved results.
+//
+//
+
+#include "../include/resultWriter.hpp"
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+
+#define fieldSep "      "
+#define maxField 32   //longest number to_chars can produce here
+
+TextWriter::TextWriter(const std::string &path, int digits, size_t bufSize)
+: buf(std::max<size_t>(bufSize, 256)), used(0), precision(digits), rowStart(true)
+{
+  out = fopen(path.c_str(), "wb");
+  if(!out)
+  {
+    throw "TextWriter: could not open output file.";
+  }
+  //everything goes through buf, stdio's own buffer would only add a copy
+  setvbuf(out, NULL, _IONBF, 0);
+}
+
+//Call flush() first to see write errors, the destructor swallows them
+TextWriter::~TextWriter()
+{
+  try
+  {
+    flush();
+  }
+  catch(const char *)
+  {
+  }
+  fclose(out);
+}
+
+void
+TextWriter::flush()
+{
+  if(used > 0 && fwrite(buf.data(), 1, used, out) != used)
+  {
+    used = 0;
+    throw "TextWriter: write failed.";
+  }
+  used = 0;
+}
+
+//Room for n more bytes
+void
+TextWriter::reserve(size_t n)
+{
+  if(used + n > buf.size())
+  {
+    flush();
+  }
+}
+
+void
+TextWriter::separate()
+{
+  reserve(sizeof(fieldSep) - 1 + maxField);
+  if(!rowStart)
+  {
+    std::memcpy(buf.data() + used, fieldSep, sizeof(fieldSep) - 1);
+    used += sizeof(fieldSep) - 1;
+  }
+  rowStart = false;
+}
+
+void
+TextWriter::field(double x)
+{
+  separate();
+  char  *first = buf.data() + used;
+  used = std::to_chars(first, first + maxField, x, std::chars_format::general, precision).ptr - buf.data();
+}
+
+void
+TextWriter::field(long i)
+{
+  separate();
+  char  *first = buf.data() + used;
+  used = std::to_chars(first, first + maxField, i).ptr - buf.data();
+}
+
+void
+TextWriter::field(int i)
+{
+  field((long)i);
+}
+
+void
+TextWriter::endRow()
+{
+  reserve(1);
+  buf[used++] = '\n';
+  rowStart = true;
+}
+
+#define columnsVersion 1
+
+static void
+writePadded(FILE *out, const void *p, size_t n, bool &ok)
+{
+  static const char zeros[8] = {0};
+  ok = ok && fwrite(p, 1, n, out) == n;
+  ok = ok && fwrite(zeros, 1, (8 - n % 8) % 8, out) == (8 - n % 8) % 8;
+}
+
+/*
+ * One call writes the whole file: k (kDim x nRows), the band index of every
+ * column and data (nRows x nCols) as stored by armadillo, i.e. column-major.
+ */
+void
+writeColumns(const std::string &path, const mat &k, const Col<sword> &index, const mat &data)
+{
+  if(k.n_cols != data.n_rows || index.n_elem != data.n_cols)
+  {
+    throw "writeColumns: k-points, band indices and data do not agree in shape.";
+  }
+  FILE      *out = fopen(path.c_str(), "wb");
+  if(!out)
+  {
+    throw "writeColumns: could not open output file.";
+  }
+  const char  magic[8] = "TBCOLS";
+  uint64_t    head[4] = {columnsVersion, data.n_rows, data.n_cols, k.n_rows};
+  bool        ok = true;
+
+  writePadded(out, magic, sizeof(magic), ok);
+  writePadded(out, head, sizeof(head), ok);
+  writePadded(out, k.memptr(), k.n_elem * sizeof(double), ok);
+  for(uword c = 0; c < index.n_elem && ok; c++)
+  {
+    int64_t i = index(c);
+    writePadded(out, &i, sizeof(i), ok);
+  }
+  writePadded(out, data.memptr(), data.n_elem * sizeof(double), ok);
+  ok = (fclose(out) == 0) && ok;
+  if(!ok)
+  {
+    throw "writeColumns: write failed.";
+  }
+}
+
+int
+outputFormatArg(int &argc, char *argv[])
+{
+  if(argc > 1)
+  {
+    std::string last = argv[argc - 1];
+    if(last == "-text" || last == "-binary" || last == "-both")
+    {
+      argc--;
+      return (last == "-text") ? textOutput
+           : (last == "-binary") ? binaryOutput : (textOutput | binaryOutput);
+    }
+  }
+  return textOutput;
+}
@@ -0,0 +1,188 @@
+//
+//  shiftInvert.cpp
+//
+//
+//  Interior eigenpairs of large sparse Hamiltonians.
+//
+//
+
+#include "../include/shiftInvert.hpp"
+#include <random>
+
+/*
+ * Solves (H - sigma) x = b for Hermitian H by MINRES (Paige & Saunders),
+ * which only needs products with H and works for the indefinite shifted
+ * matrix. Stops once the residual estimate drops below tol * ||b||.
+ */
+cx_vec
+minres(const sp_cx_mat &H, double sigma, const cx_vec &b, double tol, int maxIter)
+{
+  uword   n = b.n_elem;
+  cx_vec  x(n, fill::zeros),
+          r1 = b,
+          r2 = b,
+          y = b,
+          v,
+          w(n, fill::zeros),
+          w1,
+          w2(n, fill::zeros);
+  double  beta1 = norm(b),
+          beta = beta1,
+          oldb = 0,
+          alfa,
+          dbar = 0,
+          epsln = 0,
+          oldeps,
+          delta,
+          gbar,
+          gamma,
+          phi,
+          phibar = beta1,
+          cs = -1,
+          sn = 0;
+  
+  if(beta1 == 0)
+  {
+    return x;
+  }
+  for(int itn = 1; itn <= maxIter; itn++)
+  {
+    v = y / beta;
+    y = H * v - sigma * v;
+    if(itn >= 2)
+    {
+      y -= (beta / oldb) * r1;
+    }
+    alfa = std::real(cdot(v, y));
+    y -= (alfa / beta) * r2;
+    r1 = r2;
+    r2 = y;
+    oldb = beta;
+    beta = norm(y);
+    
+    //next plane rotation of the tridiagonal QR
+    oldeps = epsln;
+    delta = cs * dbar + sn * alfa;
+    gbar = sn * dbar - cs * alfa;
+    epsln = sn * beta;
+    dbar = -cs * beta;
+    gamma = std::max(std::sqrt(gbar * gbar + beta * beta), datum::eps);
+    cs = gbar / gamma;
+    sn = beta / gamma;
+    phi = cs * phibar;
+    phibar = sn * phibar;
+    
+    w1 = w2;
+    w2 = w;
+    w = (v - oldeps * w1 - delta * w2) / gamma;
+    x += phi * w;
+    
+    if(std::abs(phibar) < tol * beta1 || beta == 0)
+    {
+      break;
+    }
+  }
+  return x;
+}
+
+/*
+ * Gaussian starting block for eigsNear (n x min(n, 2 nev + 4)), drawn from
+ * its own generator so that it depends on seed only, not on the thread or
+ * on earlier draws.
+ */
+cx_mat
+startBlock(int n, int nev, unsigned seed)
+{
+  std::mt19937_64                   gen(seed);
+  std::normal_distribution<double>  gauss;
+  cx_mat                            X(n, std::min(n, 2 * nev + 4));
+  
+  for(uword i = 0; i < X.n_elem; i++)
+  {
+    double  re = gauss(gen);
+    X(i) = cx_double(re, gauss(gen));
+  }
+  return X;
+}
+
+/*
+ * The nev eigenvalues of Hermitian sparse H closest to sigma, ascending, by
+ * block shift-invert subspace iteration: X <- (H - sigma)^-1 X, followed by a
+ * Rayleigh-Ritz step with H itself, until the residuals of the nev Ritz pairs
+ * nearest sigma are below tol. A few extra vectors speed up convergence.
+ * X is the iteration block; if it already has the right shape (e.g. from the
+ * previous k-point) it is used as the starting guess, and on return it holds
+ * the Ritz vectors ordered by distance from sigma. The shifted systems are
+ * factorised by SuperLU when Armadillo has it and solved by MINRES otherwise;
+ * the MINRES tolerance follows the outer iteration, a tenth of the current
+ * relative residual, but no tighter than a tenth of tol.
+ */
+vec
+eigsNear(const sp_cx_mat &H, int nev, double sigma, cx_mat &X, cx_mat *eigvec, double tol)
+{
+  int         n = H.n_rows,
+              p = std::min(n, 2 * nev + 4),
+              maxIter = 200;
+  double      inner = 1e-2;   //MINRES tolerance
+  
+  if(H.n_rows != H.n_cols || nev < 1 || nev > n)
+  {
+    throw "function eigsNear : need a square matrix and 1 <= nev <= its dimension";
+  }
+  if(X.n_rows != (uword)n || X.n_cols != (uword)p)
+  {
+    X = startBlock(n, nev, 0);
+  }
+  
+#ifdef ARMA_USE_SUPERLU
+  sp_cx_mat   A = H - sigma * speye<sp_cx_mat>(n, n);
+#endif
+  vec         theta;
+  cx_mat      Y(n, p),
+              Q, HQ, G, W, R;
+  uvec        order;
+  
+  for(int iter = 0; iter < maxIter; iter++)
+  {
+#ifdef ARMA_USE_SUPERLU
+    if(!spsolve(Y, A, X))
+    {
+      throw "function eigsNear : shifted matrix is singular, move the target";
+    }
+#else
+    for(int j = 0; j < p; j++)
+    {
+      Y.col(j) = minres(H, sigma, X.col(j), inner, std::min(4 * n, 5000));
+    }
+#endif
+    Q = orth(Y);
+    HQ = H * Q;
+    G = Q.t() * HQ;
+    G = .5 * (G + G.t());
+    eig_sym(theta, W, G);
+    order = sort_index(abs(theta - sigma));
+    theta = theta.elem(order);
+    W = W.cols(order);
+    X = Q * W;
+    
+    R = HQ * W.cols(0, nev - 1) - X.cols(0, nev - 1) * diagmat(theta.head(nev));
+    double  worst = 0,
+            scale = std::max(1.0, max(abs(theta.head(nev))));
+    for(int j = 0; j < nev; j++)
+    {
+      worst = std::max(worst, norm(R.col(j)));
+    }
+    if(worst < tol * scale)
+    {
+      vec     energies = theta.head(nev);
+      uvec    asc = sort_index(energies);
+      if(eigvec)
+      {
+        *eigvec = X.cols(asc);
+      }
+      return energies.elem(asc);
+    }
+    inner = std::min(inner, std::max(.1 * worst / scale, .1 * tol));
+  }
+  throw "function eigsNear : shift-invert iteration did not converge";
+}
@@ -0,0 +1,269 @@
+//
+//  subspaceSolver.cpp
+//  
+//
+//  Continuation eigensolver for Hamiltonians sampled at neighbouring k-points.
+//
+//
+
+#include "../include/subspaceSolver.hpp"
+
+//Defaults shared by the constructors
+void
+SubspaceSolver::init()
+{
+  byWindow = false;
+  warm = false;
+  mixed = false;
+  first = last = lo = hi = 0;
+  guard = 2;
+  maxIter = 4;
+  checkInterval = 16;
+  sinceCheck = 0;
+  failures = 0;
+  found = 0;
+  eMin = eMax = 0;
+  tol = 1e-10;
+  margin = 1e-4;
+}
+
+SubspaceSolver::SubspaceSolver()
+{
+  init();
+}
+
+//Tracks bands firstBand..lastBand (0-based, inclusive)
+SubspaceSolver::SubspaceSolver(int firstBand, int lastBand)
+{
+  init();
+  first = firstBand;
+  last = lastBand;
+}
+
+//Tracks every band inside (windowMin, windowMax]
+SubspaceSolver::SubspaceSolver(double windowMin, double windowMax)
+{
+  init();
+  byWindow = true;
+  guard = 4;
+  eMin = windowMin;
+  eMax = windowMax;
+}
+
+void
+SubspaceSolver::reset()
+{
+  warm = false;
+  sinceCheck = 0;
+}
+
+void
+SubspaceSolver::setMixedPrecision(bool on)
+{
+  mixed = on;
+}
+
+void
+SubspaceSolver::setIndexCheck(int interval, double edgeMargin)
+{
+  checkInterval = std::max(interval, 0);
+  margin = edgeMargin;
+}
+
+int
+SubspaceSolver::indexFailures() const
+{
+  return failures;
+}
+
+//0-based band index of the lowest eigenvalue returned by the last solve
+int
+SubspaceSolver::firstIndex() const
+{
+  return found;
+}
+
+/*
+ * Dense solve that (re)starts the tracking. Returns the eigenvalues of the
+ * whole block lo..hi. With single set the solve is done in single precision
+ * and X only holds approximate eigenvectors, to be refined by track.
+ */
+vec
+SubspaceSolver::seed(const cx_mat &H, bool single)
+{
+  int     n = H.n_rows;
+  vec     energies;
+  
+  if(byWindow)
+  {
+    //values only up to eMax locate the window, then vectors for lo..hi
+    double  bound = norm(H, "inf") + 1;   //Gershgorin: no eigenvalue below -bound
+    vec     below;
+    if(single)
+    {
+      below = conv_to<vec>::from(eigWindow(conv_to<cx_fmat>::from(H), (float)-bound, (float)eMax));
+    }
+    else
+    {
+      below = eigWindow(H, -bound, eMax);
+    }
+    first = std::min((int)accu(below <= eMin), n - 1);
+    last = std::max(first, (int)below.n_elem - 1);
+  }
+  lo = std::max(first - guard, 0);
+  hi = std::min(last + guard, n - 1);
+  if(single)
+  {
+    cx_fmat Uf;
+    energies = conv_to<vec>::from(eigRange(conv_to<cx_fmat>::from(H), lo, hi, &Uf));
+    X = orth(conv_to<cx_mat>::from(Uf));  //single precision vectors are only orthonormal to ~1e-7
+  }
+  else
+  {
+    energies = eigRange(H, lo, hi, &X);
+  }
+  warm = true;
+  return energies;
+}
+
+/*
+ * Refines the previous block for the new matrix. Returns the eigenvalues of
+ * the block, or an empty vector if the residuals did not converge.
+ */
+vec
+SubspaceSolver::track(const cx_mat &H)
+{
+  int     m = hi - lo + 1;
+  vec     theta,
+          vals;
+  cx_mat  HX = H * X,
+          G, Y, R, V, HV;
+  rowvec  overlap;
+  uvec    order,
+          keep;
+  
+  for(int iter = 0; iter <= maxIter; iter++)
+  {
+    //Rayleigh-Ritz on span(X)
+    G = X.t() * HX;
+    eig_sym(theta, Y, G);
+    X = X * Y;
+    HX = HX * Y;
+    R = HX - X * diagmat(theta);
+    
+    double  worst = 0;
+    for(int j = 0; j < m; j++)
+    {
+      worst = std::max(worst, norm(R.col(j)));
+    }
+    if(worst < tol * std::max(1.0, max(abs(theta))))
+    {
+      return theta;
+    }
+    if(iter == maxIter)
+    {
+      break;
+    }
+    
+    //expand with the residuals and keep the Ritz vectors closest to the block
+    V = orth(join_rows(X, R));
+    HV = H * V;
+    G = V.t() * HV;
+    eig_sym(vals, Y, G);
+    overlap = sum(square(abs(X.t() * V * Y)), 0);
+    order = sort_index(overlap, "descend");
+    keep = sort(order.head(m));
+    X = V * Y.cols(keep);
+    HX = HV * Y.cols(keep);
+  }
+  return vec();
+}
+
+//In window mode the guard bands must still enclose the window
+bool
+SubspaceSolver::encloses(const vec &block, int n) const
+{
+  if(block.is_empty())
+  {
+    return false;
+  }
+  return !byWindow || !((lo > 0 && block(0) > eMin) || (hi < n - 1 && block(block.n_elem - 1) <= eMax));
+}
+
+//A guard Ritz value within margin of a wanted edge (index mode)
+bool
+SubspaceSolver::crowded(const vec &block) const
+{
+  if(byWindow || block.is_empty())
+  {
+    return false;
+  }
+  return (first > lo && block(first - lo) - block(first - lo - 1) < margin)
+      || (last < hi && block(last - lo + 1) - block(last - lo) < margin);
+}
+
+//Dense check that the tracked block still holds the wanted bands
+bool
+SubspaceSolver::sameBands(const cx_mat &H, const vec &block) const
+{
+  vec     exact,
+          tracked;
+  if(byWindow)
+  {
+    exact = eigWindow(H, eMin, eMax);
+    tracked = block.elem(find((block > eMin) && (block <= eMax)));
+  }
+  else
+  {
+    exact = eigRange(H, first, last);
+    tracked = block.subvec(first - lo, last - lo);
+  }
+  return exact.n_elem == tracked.n_elem
+      && (exact.is_empty() || max(abs(exact - tracked)) <= 1e3 * tol * std::max(1.0, max(abs(exact))));
+}
+
+/*
+ * Wanted eigenvalues of H, ascending: bands first..last in index mode, the
+ * bands inside the window in window mode.
+ */
+vec
+SubspaceSolver::solve(const cx_mat &H)
+{
+  vec     block;
+  
+  if(warm && X.n_rows == H.n_rows)
+  {
+    block = track(H);
+    if(crowded(block))
+    {
+      block.reset();
+    }
+    else if(!block.is_empty() && checkInterval > 0 && ++sinceCheck >= checkInterval)
+    {
+      sinceCheck = 0;
+      if(encloses(block, H.n_rows) && !sameBands(H, block))
+      {
+        failures++;
+        block.reset();
+      }
+    }
+  }
+  if(!encloses(block, H.n_rows) && mixed)
+  {
+    seed(H, true);
+    block = track(H);
+  }
+  if(!encloses(block, H.n_rows))
+  {
+    block = seed(H, false);
+  }
+  
+  if(byWindow)
+  {
+    uvec  inside = find((block > eMin) && (block <= eMax));
+    found = lo + (inside.is_empty() ? 0 : inside(0));
+    return block.elem(inside);
+  }
+  found = first;
+  return block.subvec(first - lo, last - lo);
+}
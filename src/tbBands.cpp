@@ -23,18 +23,34 @@ using namespace arma;
 int
 main(int argc, char* argv[])
 {
-  if(argc != 2)
+  int format = outputFormatArg(argc, argv);
+  if(argc < 2 || argc > 5)
   {
-    cerr << "routine tbBands: Improper number of command line arguments specified (1)" << std::endl;
+    cerr << "routine tbBands: Improper number of command line arguments specified (1 to 4)" << std::endl;
+    cerr << "usage: tbBands seedname [eMin eMax] [threads] [-text|-binary|-both]" << std::endl;
   }
   else
   {
     clock_t t = clock();
     std::string seedname = argv[1];
+    double      eMin = -datum::inf,
+                eMax = datum::inf;
+    int         threads = defaultThreads();
+    if(argc >= 4)
+    {
+      sscanf(argv[2], "%lf", &eMin);
+      sscanf(argv[3], "%lf", &eMax);
+    }
+    if(argc == 3 || argc == 5)
+    {
+      sscanf(argv[argc - 1], "%d", &threads);
+    }
     TightBinding tb(seedname);
+    tb.setThreads(threads);
+    tb.setOutputFormat(format);
     try
     {
-      tb.computeBands();
+      tb.computeBands(eMin, eMax);
       std::cout << "\nFinished" << std::endl;
       t = clock() - t;
       int  time = t / CLOCKS_PER_SEC,
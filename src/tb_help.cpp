@@ -6,9 +6,28 @@
 //
 
 #include "../include/tb_help.hpp"
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #define kB 8.61733035e-5  //Boltzmann's constant in units of eV / K
 
+/*
+ * LAPACK prototypes with the hidden string lengths gfortran appends for each
+ * character argument (jobz, range, uplo); leaving them out is undefined
+ * behaviour with gfortran >= 8 builds of LAPACK.
+ */
+extern "C" void zheevr_(char *jobz, char *range, char *uplo, int *n, cx_double *a, int *lda,
+                        double *vl, double *vu, int *il, int *iu, double *abstol, int *m,
+                        double *w, cx_double *z, int *ldz, int *isuppz, cx_double *work,
+                        int *lwork, double *rwork, int *lrwork, int *iwork, int *liwork,
+                        int *info, size_t jobz_len, size_t range_len, size_t uplo_len);
+extern "C" void cheevr_(char *jobz, char *range, char *uplo, int *n, cx_float *a, int *lda,
+                        float *vl, float *vu, int *il, int *iu, float *abstol, int *m,
+                        float *w, cx_float *z, int *ldz, int *isuppz, cx_float *work,
+                        int *lwork, float *rwork, int *lrwork, int *iwork, int *liwork,
+                        int *info, size_t jobz_len, size_t range_len, size_t uplo_len);
+
 //'dataInput.cpp' help functions
 
 template<typename Out>
@@ -58,6 +77,169 @@ cexp(double x)
   return rVal;
 }
 
+/*
+ * Vectorised exp(ix) for an array of phases, out[i] = cos(x[i]) + i sin(x[i]).
+ * Arguments are reduced by pi/2 (three-part Cody-Waite) and sin/cos evaluated
+ * with the fdlibm minimax polynomials on [-pi/4, pi/4]. Arguments beyond
+ * phaseLimit go through std::cos/std::sin, since the reduction loses accuracy
+ * there. Uses AVX-512 or AVX2 when compiled for them, plain loops otherwise.
+ */
+#define phaseLimit 1e5
+
+static const double twoOverPi = 6.36619772367581382433e-01,
+                    pio2_1 = 1.57079632673412561417e+00,
+                    pio2_2 = 6.07710050630396597660e-11,
+                    pio2_3 = 2.02226624871116645580e-21,
+                    S1 = -1.66666666666666324348e-01,
+                    S2 = 8.33333333332248946124e-03,
+                    S3 = -1.98412698298579493134e-04,
+                    S4 = 2.75573137070700676789e-06,
+                    S5 = -2.50507602534068634195e-08,
+                    S6 = 1.58969099521155010221e-10,
+                    C1 = 4.16666666666666019037e-02,
+                    C2 = -1.38888888888741095749e-03,
+                    C3 = 2.48015872894767294178e-05,
+                    C4 = -2.75573143513906633035e-07,
+                    C5 = 2.08757232129817482790e-09,
+                    C6 = -1.13596475577881948265e-11;
+
+static inline void
+sincosScalar(double x, double &s, double &c)
+{
+  if(std::abs(x) > phaseLimit)
+  {
+    s = std::sin(x);
+    c = std::cos(x);
+    return;
+  }
+  double  q = std::nearbyint(x * twoOverPi),
+          r = ((x - q * pio2_1) - q * pio2_2) - q * pio2_3,
+          z = r * r,
+          sr = r + r * z * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6))))),
+          cr = 1 - .5 * z + z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+  long    n = (long)q;
+
+  if(n & 1)
+  {
+    s = cr;
+    c = sr;
+  }
+  else
+  {
+    s = sr;
+    c = cr;
+  }
+  if(n & 2)       s = -s;
+  if((n + 1) & 2) c = -c;
+}
+
+void
+cexp(const double *x, std::complex<double> *out, uword n)
+{
+  double  *o = reinterpret_cast<double *>(out);
+  uword   i = 0;
+
+#if defined(__AVX512F__)
+  const __m512d   vTwoOverPi = _mm512_set1_pd(twoOverPi),
+                  vLimit = _mm512_set1_pd(phaseLimit);
+  const __m512i   absMask = _mm512_set1_epi64(0x7fffffffffffffffLL),
+                  one = _mm512_set1_epi64(1),
+                  two = _mm512_set1_epi64(2),
+                  lowIdx = _mm512_set_epi64(11, 3, 10, 2, 9, 1, 8, 0),
+                  highIdx = _mm512_set_epi64(15, 7, 14, 6, 13, 5, 12, 4);
+  for(; i + 8 <= n; i += 8)
+  {
+    __m512d   vx = _mm512_loadu_pd(x + i),
+              ax = _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(vx), absMask));
+    if(_mm512_cmp_pd_mask(ax, vLimit, _CMP_GT_OQ))
+    {
+      for(uword j = i; j < i + 8; j++)
+      {
+        sincosScalar(x[j], o[2 * j + 1], o[2 * j]);
+      }
+      continue;
+    }
+    __m512d   q = _mm512_roundscale_pd(_mm512_mul_pd(vx, vTwoOverPi), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+              r = _mm512_fnmadd_pd(q, _mm512_set1_pd(pio2_1), vx);
+    r = _mm512_fnmadd_pd(q, _mm512_set1_pd(pio2_2), r);
+    r = _mm512_fnmadd_pd(q, _mm512_set1_pd(pio2_3), r);
+    __m512d   z = _mm512_mul_pd(r, r),
+              ps = _mm512_fmadd_pd(z, _mm512_set1_pd(S6), _mm512_set1_pd(S5)),
+              pc = _mm512_fmadd_pd(z, _mm512_set1_pd(C6), _mm512_set1_pd(C5));
+    ps = _mm512_fmadd_pd(z, ps, _mm512_set1_pd(S4));
+    ps = _mm512_fmadd_pd(z, ps, _mm512_set1_pd(S3));
+    ps = _mm512_fmadd_pd(z, ps, _mm512_set1_pd(S2));
+    ps = _mm512_fmadd_pd(z, ps, _mm512_set1_pd(S1));
+    pc = _mm512_fmadd_pd(z, pc, _mm512_set1_pd(C4));
+    pc = _mm512_fmadd_pd(z, pc, _mm512_set1_pd(C3));
+    pc = _mm512_fmadd_pd(z, pc, _mm512_set1_pd(C2));
+    pc = _mm512_fmadd_pd(z, pc, _mm512_set1_pd(C1));
+    __m512d   sr = _mm512_fmadd_pd(_mm512_mul_pd(r, z), ps, r),
+              cr = _mm512_fmadd_pd(_mm512_mul_pd(z, z), pc, _mm512_fnmadd_pd(_mm512_set1_pd(.5), z, _mm512_set1_pd(1)));
+    __m512i   qi = _mm512_cvtepi32_epi64(_mm512_cvtpd_epi32(q));
+    __mmask8  swap = _mm512_test_epi64_mask(qi, one);
+    __m512i   sSign = _mm512_slli_epi64(_mm512_and_si512(qi, two), 62),
+              cSign = _mm512_slli_epi64(_mm512_and_si512(_mm512_add_epi64(qi, one), two), 62);
+    __m512d   s = _mm512_mask_blend_pd(swap, sr, cr),
+              c = _mm512_mask_blend_pd(swap, cr, sr);
+    s = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(s), sSign));
+    c = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(c), cSign));
+    _mm512_storeu_pd(o + 2 * i, _mm512_permutex2var_pd(c, lowIdx, s));
+    _mm512_storeu_pd(o + 2 * i + 8, _mm512_permutex2var_pd(c, highIdx, s));
+  }
+#elif defined(__AVX2__)
+  const __m256d   vTwoOverPi = _mm256_set1_pd(twoOverPi),
+                  vLimit = _mm256_set1_pd(phaseLimit),
+                  absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+  const __m256i   one = _mm256_set1_epi64x(1),
+                  two = _mm256_set1_epi64x(2);
+  for(; i + 4 <= n; i += 4)
+  {
+    __m256d   vx = _mm256_loadu_pd(x + i);
+    if(_mm256_movemask_pd(_mm256_cmp_pd(_mm256_and_pd(vx, absMask), vLimit, _CMP_GT_OQ)))
+    {
+      for(uword j = i; j < i + 4; j++)
+      {
+        sincosScalar(x[j], o[2 * j + 1], o[2 * j]);
+      }
+      continue;
+    }
+    __m256d   q = _mm256_round_pd(_mm256_mul_pd(vx, vTwoOverPi), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+              r = _mm256_sub_pd(vx, _mm256_mul_pd(q, _mm256_set1_pd(pio2_1)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(q, _mm256_set1_pd(pio2_2)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(q, _mm256_set1_pd(pio2_3)));
+    __m256d   z = _mm256_mul_pd(r, r),
+              ps = _mm256_add_pd(_mm256_mul_pd(z, _mm256_set1_pd(S6)), _mm256_set1_pd(S5)),
+              pc = _mm256_add_pd(_mm256_mul_pd(z, _mm256_set1_pd(C6)), _mm256_set1_pd(C5));
+    ps = _mm256_add_pd(_mm256_mul_pd(z, ps), _mm256_set1_pd(S4));
+    ps = _mm256_add_pd(_mm256_mul_pd(z, ps), _mm256_set1_pd(S3));
+    ps = _mm256_add_pd(_mm256_mul_pd(z, ps), _mm256_set1_pd(S2));
+    ps = _mm256_add_pd(_mm256_mul_pd(z, ps), _mm256_set1_pd(S1));
+    pc = _mm256_add_pd(_mm256_mul_pd(z, pc), _mm256_set1_pd(C4));
+    pc = _mm256_add_pd(_mm256_mul_pd(z, pc), _mm256_set1_pd(C3));
+    pc = _mm256_add_pd(_mm256_mul_pd(z, pc), _mm256_set1_pd(C2));
+    pc = _mm256_add_pd(_mm256_mul_pd(z, pc), _mm256_set1_pd(C1));
+    __m256d   sr = _mm256_add_pd(r, _mm256_mul_pd(_mm256_mul_pd(r, z), ps)),
+              cr = _mm256_add_pd(_mm256_sub_pd(_mm256_set1_pd(1), _mm256_mul_pd(_mm256_set1_pd(.5), z)),
+                                 _mm256_mul_pd(_mm256_mul_pd(z, z), pc));
+    __m256i   qi = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(q));
+    __m256d   swap = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(qi, one), one)),
+              sSign = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(qi, two), 62)),
+              cSign = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(_mm256_add_epi64(qi, one), two), 62)),
+              s = _mm256_xor_pd(_mm256_blendv_pd(sr, cr, swap), sSign),
+              c = _mm256_xor_pd(_mm256_blendv_pd(cr, sr, swap), cSign),
+              lo = _mm256_unpacklo_pd(c, s),
+              hi = _mm256_unpackhi_pd(c, s);
+    _mm256_storeu_pd(o + 2 * i, _mm256_permute2f128_pd(lo, hi, 0x20));
+    _mm256_storeu_pd(o + 2 * i + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+  }
+#endif
+  for(; i < n; i++)
+  {
+    sincosScalar(x[i], o[2 * i + 1], o[2 * i]);
+  }
+}
+
 mat
 merge(mat left, mat right)
 {
@@ -191,6 +373,56 @@ mergeSort(vec v)
 }*/
 
 
+//All nondecreasing index tuples i_1 <= ... <= i_order with entries below dim,
+//one per column in lexicographic order. These label the independent slices
+//of a symmetric derivative tensor.
+umat
+symmetricIndices(int dim, int order)
+{
+  std::vector<uword>                tuple(order, 0);
+  std::vector<std::vector<uword> >  tuples;
+  
+  while(true)
+  {
+    tuples.push_back(tuple);
+    int l = order - 1;
+    while(l >= 0 && tuple[l] == dim - 1)
+    {
+      l--;
+    }
+    if(l < 0)
+    {
+      break;
+    }
+    tuple[l]++;
+    for(int m = l + 1; m < order; m++)
+    {
+      tuple[m] = tuple[l];
+    }
+  }
+  
+  umat rVal(order, tuples.size());
+  for(uword c = 0; c < tuples.size(); c++)
+  {
+    for(int l = 0; l < order; l++)
+    {
+      rVal(l, c) = tuples[c][l];
+    }
+  }
+  return rVal;
+}
+
+//Position of the pair (a, b) in symmetricIndices(dim, 2)
+int
+symIndex(int a, int b, int dim)
+{
+  if(a > b)
+  {
+    std::swap(a, b);
+  }
+  return a * dim - a * (a - 1) / 2 + (b - a);
+}
+
 int factorial(int n)
 {
   if (n < 0)
@@ -438,17 +670,17 @@ main()  //Testing purposes
   v.print();
 }*/
 
-vec changeBasis(mat A, mat B, mat y)
+vec changeBasis(const mat &A, const mat &B, const mat &y)
 {
-  return inv(A) * B * y;
+  return solve(A, B * y);
 }
 
-vec changeBasis(mat A, mat y)
+vec changeBasis(const mat &A, const mat &y)
 {
-  return inv(A) * y;
+  return solve(A, y);
 }
 
-mat recipLat(mat lat)
+mat recipLat(const mat &lat)
 {
   unsigned  latticeDim  = (unsigned)lat.n_cols;
   mat				recip(latticeDim, latticeDim);
@@ -572,6 +804,117 @@ downFold(cx_mat H, int val, int cond) //
   return H00 + T01 * inv(H11) * T10;
 }
 
+static void
+lapackHeevr(char *jobz, char *range, char *uplo, int *n, cx_double *a, int *lda,
+            double *vl, double *vu, int *il, int *iu, double *abstol, int *m,
+            double *w, cx_double *z, int *ldz, int *isuppz, cx_double *work,
+            int *lwork, double *rwork, int *lrwork, int *iwork, int *liwork, int *info)
+{
+  zheevr_(jobz, range, uplo, n, a, lda, vl, vu, il, iu, abstol, m, w, z, ldz, isuppz,
+          work, lwork, rwork, lrwork, iwork, liwork, info, 1, 1, 1);
+}
+
+static void
+lapackHeevr(char *jobz, char *range, char *uplo, int *n, cx_float *a, int *lda,
+            float *vl, float *vu, int *il, int *iu, float *abstol, int *m,
+            float *w, cx_float *z, int *ldz, int *isuppz, cx_float *work,
+            int *lwork, float *rwork, int *lrwork, int *iwork, int *liwork, int *info)
+{
+  cheevr_(jobz, range, uplo, n, a, lda, vl, vu, il, iu, abstol, m, w, z, ldz, isuppz,
+          work, lwork, rwork, lrwork, iwork, liwork, info, 1, 1, 1);
+}
+
+/*
+ * Partial Hermitian eigensolver (LAPACK zheevr / cheevr). range is 'I' for
+ * the eigenvalues with (1-based) indices il..iu, or 'V' for those in
+ * (vl, vu]. Only the requested eigenpairs are computed; eigenvalues come
+ * back ascending and eigenvectors, if eigvec is non-null, in the matching
+ * columns.
+ */
+template<typename T>
+static Col<T>
+heevr(const Mat<std::complex<T> > &H, char range, T vl, T vu, int il, int iu, Mat<std::complex<T> > *eigvec)
+{
+  if(H.n_rows != H.n_cols)
+  {
+    throw "function eigRange : Hamiltonian matrix must be square";
+  }
+  char                    jobz = eigvec ? 'V' : 'N',
+                          uplo = 'U';
+  int                     n = H.n_rows,
+                          lda = n,
+                          ldz = eigvec ? n : 1,
+                          m = 0,
+                          info = 0,
+                          lwork = -1,
+                          lrwork = -1,
+                          liwork = -1,
+                          iworkSize;
+  T                       abstol = 0,
+                          rworkSize;
+  std::complex<T>         workSize;
+  Mat<std::complex<T> >   A(H),
+                          Z(ldz, eigvec ? n : 1);
+  Col<T>                  w(n);
+  std::vector<int>        isuppz(2 * n);
+  
+  //workspace query, then the actual solve
+  lapackHeevr(&jobz, &range, &uplo, &n, A.memptr(), &lda, &vl, &vu, &il, &iu, &abstol, &m,
+              w.memptr(), Z.memptr(), &ldz, isuppz.data(), &workSize, &lwork, &rworkSize,
+              &lrwork, &iworkSize, &liwork, &info);
+  lwork = (int)workSize.real();
+  lrwork = (int)rworkSize;
+  liwork = iworkSize;
+  std::vector<std::complex<T> > work(lwork);
+  std::vector<T>          rwork(lrwork);
+  std::vector<int>        iwork(liwork);
+  lapackHeevr(&jobz, &range, &uplo, &n, A.memptr(), &lda, &vl, &vu, &il, &iu, &abstol, &m,
+              w.memptr(), Z.memptr(), &ldz, isuppz.data(), work.data(), &lwork, rwork.data(),
+              &lrwork, iwork.data(), &liwork, &info);
+  if(info != 0)
+  {
+    throw "function eigRange : LAPACK heevr failed";
+  }
+  
+  if(eigvec)
+  {
+    eigvec->set_size(n, m);
+    if(m > 0)
+    {
+      *eigvec = Z.cols(0, m - 1);
+    }
+  }
+  w.resize(m);
+  return w;
+}
+
+//Eigenvalues il..iu (0-based, inclusive) of Hermitian H, ascending
+vec
+eigRange(const cx_mat &H, int il, int iu, cx_mat *eigvec)
+{
+  return heevr<double>(H, 'I', 0, 0, il + 1, iu + 1, eigvec);
+}
+
+//Single precision version, for screening and for seeding a double refinement
+fvec
+eigRange(const cx_fmat &H, int il, int iu, cx_fmat *eigvec)
+{
+  return heevr<float>(H, 'I', 0, 0, il + 1, iu + 1, eigvec);
+}
+
+//Eigenvalues of Hermitian H in the window (vl, vu], ascending
+vec
+eigWindow(const cx_mat &H, double vl, double vu, cx_mat *eigvec)
+{
+  return heevr<double>(H, 'V', vl, vu, 0, 0, eigvec);
+}
+
+fvec
+eigWindow(const cx_fmat &H, float vl, float vu, cx_fmat *eigvec)
+{
+  return heevr<float>(H, 'V', vl, vu, 0, 0, eigvec);
+}
+
 void
 printMat(mat x)
 {
@@ -8,9 +8,73 @@
 
 #include <stdio.h>
 #include "../include/tightBinding.hpp"
+#include "../include/hamMesh.hpp"
+
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
 
 #define PI 3.141592653589793
 
+/*
+ * Heap allocation counter for the Ham check below. operator new covers the
+ * standard library, posix_memalign is what armadillo allocates with. The
+ * posix_memalign hook forwards to a glibc internal, so with other C
+ * libraries only operator new is counted.
+ */
+static std::atomic<long>  heapAllocs(0);
+static std::atomic<bool>  countAllocs(false);
+
+void*
+operator new(std::size_t n)
+{
+  if(countAllocs)
+  {
+    heapAllocs++;
+  }
+  void  *p = std::malloc(n ? n : 1);
+  if(!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_memalign(size_t alignment, size_t n);
+
+extern "C" int
+posix_memalign(void **p, size_t alignment, size_t n)
+{
+  if(countAllocs)
+  {
+    heapAllocs++;
+  }
+  *p = __libc_memalign(alignment, n);
+  return *p ? 0 : ENOMEM;
+}
+#endif
+
+//Prints the error of a check and fails the run if it is above tol
+static void
+checkError(const std::string &what, double err, double tol)
+{
+  std::cout << what << " max error: " << err << " (tolerance " << tol << ")" << std::endl;
+  if(!(err <= tol))
+  {
+    throw what + " exceeds its tolerance";
+  }
+}
+
 int main()
 {
   clock_t t = clock();
@@ -44,6 +108,159 @@ int main()
     //std::cout << tb.kVecs() << std::endl;
     
     //std::cout << tb.fermiVel(e) - tb.buildHam(e);
+    //vectorised phase kernel against std::cos / std::sin
+    vec     x = 4000 * randu<vec>(100003) - 2000;
+    cx_vec  ph(x.n_elem);
+    double  phErr = 0;
+    x(7) = 3e7;
+    cexp(x.memptr(), ph.memptr(), x.n_elem);
+    for(uword i = 0; i < x.n_elem; i++)
+    {
+      phErr = std::max(phErr, std::abs(ph(i) - cx_double(std::cos(x(i)), std::sin(x(i)))));
+    }
+    checkError("Phase kernel", phErr, 1e-14);
+    
+    //FFT mesh, H and dH/dk, against direct evaluation
+    HamMesh mesh(tb, 5, 4, 3, 1);
+    double  meshErr = 0;
+    while(mesh.next())
+    {
+      std::vector<cx_cube>  dH = tb.HamDerivatives(mesh.k(), 1);
+      meshErr = std::max(meshErr, (double)norm(mesh.H() - dH[0].slice(0), "inf"));
+      for(uword a = 0; a < dH[1].n_slices; a++)
+      {
+        meshErr = std::max(meshErr, (double)norm(mesh.dH().slice(a) - dH[1].slice(a), "inf"));
+      }
+    }
+    checkError("FFT mesh", meshErr, 1e-9);
+    
+    //phase recurrence along a path against direct evaluation
+    vec     dk = (e - G) / 1000;
+    cx_cube Hp = tb.HamPath(G, dk, 1001);
+    double  pathErr = 0;
+    for(int j = 0; j <= 1000; j += 37)
+    {
+      pathErr = std::max(pathErr, (double)norm(Hp.slice(j) - tb.Ham(G + j * dk), "inf"));
+    }
+    checkError("Path recurrence", pathErr, 1e-9);
+    
+    //Ham into reused buffers must not allocate once warmed up, on the fixed
+    //size kernel, the general half table and the full table
+    cx_mat      Hk;
+    HamScratch  scratch;
+    const char  *tables[3] = {"half, fixed kernel", "half", "full"};
+    for(int fill = 0; fill < 3; fill++)
+    {
+      tb.setHermitianFill(fill < 2);
+      tb.setFixedKernels(fill == 0);
+      tb.Ham(e, Hk, scratch);
+      heapAllocs = 0;
+      countAllocs = true;
+      for(int i = 0; i < 100; i++)
+      {
+        tb.Ham(e, Hk, scratch);
+      }
+      countAllocs = false;
+      std::cout << "Heap allocations in 100 Ham calls (" << tables[fill] << " table): "
+                << heapAllocs << std::endl;
+      if(heapAllocs != 0)
+      {
+        throw std::string("Ham allocated after warm-up");
+      }
+    }
+    tb.setHermitianFill(true);
+    tb.setFixedKernels(true);
+    
+    //r_k from matrix products against the scalar O(N^4) loop it replaced
+    double  rkErr = 0,
+            rkMax = 0,
+            hBar = 6.58211951440e-16;
+    for(int j = 0; j < 3; j++)
+    {
+      vec                   kc = tb.kVecs() * (j == 0 ? e : (j == 1 ? a : d));
+      cx_cube               r, r_k;
+      vec                   E;
+      cx_mat                U;
+      std::vector<cx_cube>  dH = tb.HamDerivatives(kc, 1);
+      int                   N = dH[0].n_rows;
+      tb.positionDerivative(kc, r, r_k);
+      eig_sym(E, U, dH[0].slice(0));
+      cx_cube               v = dH[1];
+      for(uword s = 0; s < v.n_slices; s++)
+      {
+        v.slice(s) = U.t() * v.slice(s) * U;
+      }
+      for(int p = 0; p < 3; p++)
+      {
+        for(int q = 0; q < 3; q++)    //q plays the role of a
+        {
+          for(int i = 0; i < N; i++)
+          {
+            for(int l = 0; l < N; l++)
+            {
+              cx_double ref = 0;
+              if(i != l && std::abs(E(i) - E(l)) > 1e-12)
+              {
+                ref = -(r(i, l, p) * (v(i, i, q) - v(l, l, q)) + r(i, l, q) * (v(i, i, p) - v(l, l, p)));
+                for(int m = 0; m < N; m++)
+                {
+                  ref -= v(i, m, p) * r(m, l, q) - r(i, m, q) * v(m, l, p);
+                }
+                ref *= hBar / (E(i) - E(l));
+              }
+              rkErr = std::max(rkErr, std::abs(r_k(i, l, p + 3 * q) - ref));
+              rkMax = std::max(rkMax, std::abs(ref));
+            }
+          }
+        }
+      }
+    }
+    std::cout << "r_k max error: " << rkErr << " of " << rkMax << std::endl;
+    if(rkErr > 1e-9 * rkMax)
+    {
+      throw std::string("r_k does not match the reference loop");
+    }
+    
+    //shift-invert eigenpairs against the dense solver
+    {
+      cx_mat    Hd = tb.Ham(tb.kVecs() * e),
+                X;
+      vec       all = eig_sym(Hd),
+                near;
+      double    sigma = 15.2886,
+                eigErr;
+      int       nev = 6;
+      uvec      closest = sort_index(abs(all - sigma));
+      near = eigsNear(sp_cx_mat(Hd), nev, sigma, X);
+      eigErr = max(abs(near - sort(all.elem(closest.head(nev)))));
+      std::cout << "eigsNear max error: " << eigErr << std::endl;
+      if(eigErr > 1e-8)
+      {
+        throw std::string("eigsNear does not match eig_sym");
+      }
+    }
+    
+    //windowed bands must not depend on the thread count
+    {
+      std::string bandsOut[2];
+      int         threads[2] = {1, 4};
+      for(int run = 0; run < 2; run++)
+      {
+        tb.setThreads(threads[run]);
+        tb.computeBands(14, 17);
+        std::ifstream     in("../data/" + seedname + "_bands.dat", std::ios::binary);
+        std::stringstream ss;
+        ss << in.rdbuf();
+        bandsOut[run] = ss.str();
+      }
+      tb.setThreads(defaultThreads());
+      std::cout << "Windowed bands, 1 vs 4 threads: " << (bandsOut[0] == bandsOut[1] ? "identical" : "differ") << std::endl;
+      if(bandsOut[0].empty() || bandsOut[0] != bandsOut[1])
+      {
+        throw std::string("windowed band output depends on the thread count");
+      }
+    }
+    
     tb.fermiVelocity(e);
     std::cout << '\n' << tb.bandGap(e) << std::endl;
     
@@ -78,6 +295,7 @@ int main()
   catch(std::string err)
   {
     cerr << err << std::endl;
+    return EXIT_FAILURE;
   }
   catch(...)
   {
@@ -7,25 +7,70 @@
 //
 
 #include "../include/tightBinding.hpp"
+#include "../include/hamMesh.hpp"
+#include "../include/shiftInvert.hpp"
 
 /******* Constructors *******/
 
 #define hBar 6.58211951440e-16
-std::complex<double> I = std::complex<double>(0, 1);
-double pi = std::acos(-1);
+#define degenerateGap 1e-12  //eV; closer pairs get no 1 / (E_p - E_q) terms
+static const std::complex<double> I = std::complex<double>(0, 1);
 
-TightBinding::TightBinding(){}
+//An empty model, with the same settings as the seedname constructor
+TightBinding::TightBinding()
+{
+  sparse = false;
+  hamSize = 0;
+  keptTerms = totalTerms = totalBlocks = 0;
+  truncBound = 0;
+  numThreads = defaultThreads();
+  phaseReseed = 64;
+  halfFill = !sparse;
+  mixedPrecision = false;
+  gapTracking = false;
+  outputFormat = textOutput;
+  sparseTarget = 0;
+  sparseBands = 8;
+  fixedHamFn = NULL;
+  fixedGapFn = NULL;
+}
 
-TightBinding::TightBinding(std::string seed)
+TightBinding::TightBinding(std::string seed, HoppingCutoff cut, bool sparseTable)
 {
   seedname = seed;
+  cutoff = cut;
+  sparse = sparseTable;
+  numThreads = defaultThreads();
+  phaseReseed = 64;
+  halfFill = !sparse;
+  mixedPrecision = false;
+  gapTracking = false;
+  outputFormat = textOutput;
+  sparseTarget = 0;
+  sparseBands = 8;
+  fixedHamFn = NULL;
+  fixedGapFn = NULL;
+  
+  //a cache left by an earlier run on the same input skips parsing and compiling
+  if(!sparse && loadCache())
+  {
+    compileHermitian();
+    selectFixedKernels(lat.dim(), hamSize, fixedHamFn, fixedGapFn);
+    return;
+  }
+  
   lat = readWinFile(seedname);
+  //the Wigner-Seitz images are read on a second thread while _hr.dat is parsed
+  std::future<WsVecs> wsRead = std::async(std::launch::async, read_wsvecFile, seedname);
   std::vector<mat> dat = read_hrFile(seedname);
   hr_dat = dat[0];
   //hr_dat.print();
   hr_weights = dat[1];
-  wsvec_dat = dat[2];
-  wsvec_weights = dat[3];
+  wsvec = wsRead.get();
+  if(wsvec.offsets.n_elem != hr_dat.n_rows + 1 || wsvec.shifts.n_rows < lat.dim())
+  {
+    throw "Error in input file '_wsvec.dat': does not match the '_hr.dat' file.";
+  }
   int curr = hr_dat(0, lat.dim()), prev = 0, tmp, ind = 0;
   while(curr > prev)
   {
@@ -34,70 +79,252 @@ TightBinding::TightBinding(std::string seed)
     prev = tmp;
   }
   hamSize = prev;
+  if(sparse)
+  {
+    compileSparse();
+    return;
+  }
+  compileHoppings();
+  writeCache();
+  compileHermitian();
+  selectFixedKernels(lat.dim(), hamSize, fixedHamFn, fixedGapFn);
 }
 
-TightBinding::TightBinding(TightBinding &other)
+TightBinding::TightBinding(const TightBinding &other)
 {
   seedname = other.seedname;
   lat = other.lat;
   hr_dat = other.hr_dat;
   hr_weights = other.hr_weights;
-  wsvec_dat = other.wsvec_dat;
-  wsvec_weights = other.wsvec_weights;
+  wsvec = other.wsvec;
   hamSize = other.hamSize;
+  cutoff = other.cutoff;
+  truncBound = other.truncBound;
+  keptTerms = other.keptTerms;
+  totalTerms = other.totalTerms;
+  totalBlocks = other.totalBlocks;
+  numThreads = other.numThreads;
+  phaseReseed = other.phaseReseed;
+  outputFormat = other.outputFormat;
+  hop_cells = other.hop_cells;
+  hop_R = other.hop_R;
+  hop_blocks = other.hop_blocks;
+  halfFill = other.halfFill;
+  upper_ind = other.upper_ind;
+  half_R = other.half_R;
+  half_upper = other.half_upper;
+  half_lower = other.half_lower;
+  half_upper_f = other.half_upper_f;
+  half_lower_f = other.half_lower_f;
+  mixedPrecision = other.mixedPrecision;
+  gapTracking = other.gapTracking;
+  fixedHamFn = other.fixedHamFn;
+  fixedGapFn = other.fixedGapFn;
+  sparse = other.sparse;
+  sparseTarget = other.sparseTarget;
+  sparseBands = other.sparseBands;
+  sp_locations = other.sp_locations;
+  sp_pos = other.sp_pos;
+  sp_cell = other.sp_cell;
+  sp_vals = other.sp_vals;
 }
 
-/********** Methods from Lattice **********/
-
-mat
-TightBinding::latVecs()
+//Upper bound on ||A||_2 without an SVD: ||A||_2 <= sqrt(||A||_1 ||A||_inf)
+static double
+normBound(const cx_mat &A)
 {
-  return lat.latticeVectors();
+  return std::sqrt(norm(A, 1) * norm(A, "inf"));
 }
 
-mat
-TightBinding::kVecs()
+/*
+ * Folds every row of hr_dat and each of its Wigner-Seitz images into a single
+ * hopping block per lattice vector R, so that H(k) = sum_R exp(ik.R) * T(R).
+ * The ws and degeneracy weights are applied here once instead of at every
+ * k-point, and the table is truncated according to cutoff: hoppings with
+ * |t| <= cutoff.element are dropped (and the rest optionally rounded to that
+ * resolution), then whole blocks with ||T(R)||_2 <= cutoff.block. Since
+ * |exp(ik.R)| = 1, ||H(k) - H_exact(k)||_2 <= sum_R ||dT(R)||_2 for every k,
+ * which by Weyl's inequality also bounds the error of each eigenvalue; that
+ * bound is kept in truncBound and reported. The 2-norms are never computed
+ * (an SVD per block): both the pruning test and truncBound use the upper
+ * bound sqrt(||.||_1 ||.||_inf), so a block is only dropped when it is
+ * certainly below cutoff.block.
+ */
+void
+TightBinding::compileHoppings()
 {
-  return lat.kVectors();
+  int                     latDim = lat.dim(),
+                          rowIndex,
+                          colIndex,
+                          deg,
+                          a, b, ind, nind,
+                          site,
+                          keptBlocks = 0;
+  const mat               &latticeVecs = latVecs();
+  std::vector<int>        cell(latDim);
+  std::map<std::vector<int>, int> blockIndex;
+  std::vector<cx_mat>     blocks,
+                          exact;
+  std::vector<bool>       nonzero;  //block has a kept hopping
+  std::complex<double>    hoppingEnergy, weightedEnergy, exactEnergy;
+  bool                    keep;
+  
+  keptTerms = 0;
+  totalTerms = hr_dat.n_rows;
+  for(int i = 0; i < hr_dat.n_rows; i++)
+  {
+    rowIndex = hr_dat(i, latDim + 1) - 1;
+    colIndex = hr_dat(i, latDim) - 1;
+    site = i / (hamSize * hamSize);
+    ind = i % (hamSize * hamSize);
+    a = ind / hamSize;
+    b = ind % hamSize;
+    nind = hamSize * b + a + site * (hamSize * hamSize);
+    deg = wsvec.offsets(i + 1) - wsvec.offsets(i);
+    hoppingEnergy = std::complex<double>(hr_dat(nind, latDim + 2), hr_dat(nind, latDim + 3));
+    exactEnergy = hoppingEnergy / (deg * hr_weights(i / (hamSize * hamSize)));
+    
+    keep = abs(hoppingEnergy) > cutoff.element;
+    if(keep)
+    {
+      keptTerms++;
+      if(cutoff.round && cutoff.element > 0)
+      {
+        hoppingEnergy = myRound(hoppingEnergy, cutoff.element);
+      }
+    }
+    
+    weightedEnergy = hoppingEnergy / (deg * hr_weights(i / (hamSize * hamSize)));
+    for(int j = 0; j < deg; j++)
+    {
+      for(int l = 0; l < latDim; l++)
+      {
+        cell[l] = (int)std::lround(hr_dat(nind, l)) + wsvec.shifts(l, wsvec.offsets(i) + j);
+      }
+      
+      std::map<std::vector<int>, int>::iterator it = blockIndex.find(cell);
+      if(it == blockIndex.end())
+      {
+        it = blockIndex.insert(std::make_pair(cell, (int)blocks.size())).first;
+        blocks.push_back(cx_mat(hamSize, hamSize, fill::zeros));
+        exact.push_back(cx_mat(hamSize, hamSize, fill::zeros));
+        nonzero.push_back(false);
+      }
+      exact[it->second](rowIndex, colIndex) += exactEnergy;
+      if(keep)
+      {
+        blocks[it->second](rowIndex, colIndex) += weightedEnergy;
+        nonzero[it->second] = nonzero[it->second] || weightedEnergy != cx_double(0);
+      }
+    }
+  }
+  
+  //whole-block pruning, and the error bound over all blocks
+  std::vector<bool>       kept(blocks.size());
+  truncBound = 0;
+  for(size_t r = 0; r < blocks.size(); r++)
+  {
+    kept[r] = nonzero[r] && (cutoff.block <= 0 || normBound(blocks[r]) > cutoff.block);
+    if(!kept[r])
+    {
+      blocks[r].zeros();
+    }
+    keptBlocks += kept[r];
+    exact[r] -= blocks[r];
+    truncBound += normBound(exact[r]);
+  }
+  
+  hop_cells.set_size(latDim, keptBlocks);
+  hop_blocks.set_size(hamSize, hamSize, keptBlocks);
+  int   slot = 0;
+  for(std::map<std::vector<int>, int>::iterator it = blockIndex.begin(); it != blockIndex.end(); ++it)
+  {
+    if(!kept[it->second])
+    {
+      continue;
+    }
+    for(int l = 0; l < latDim; l++)
+    {
+      hop_cells(l, slot) = it->first[l];
+    }
+    hop_blocks.slice(slot++) = blocks[it->second];
+  }
+  hop_R = trans(latticeVecs * conv_to<mat>::from(hop_cells));
+  
+  totalBlocks = blocks.size();
+  reportTable();
 }
 
-cube
-TightBinding::kPoints()
+//Truncation summary, the same after compiling and after loading the cache
+void
+TightBinding::reportTable() const
 {
-  return lat.kPoints();
+  std::cout << "Hopping table: kept " << keptTerms << " of " << totalTerms << " hoppings in "
+            << hop_blocks.n_slices << " of " << totalBlocks << " lattice vectors\n"
+            << "Truncation error bound, max_k ||dH(k)||_2: " << truncBound << " eV\n" << std::endl;
 }
 
-std::vector<std::string>
-TightBinding::kPt_names_from()
+//Upper bound on the eigenvalue error introduced by the hopping cutoff
+double
+TightBinding::truncationError() const
 {
-  return lat.kPt_names_from();
+  return truncBound;
 }
 
-std::vector<std::string>
-TightBinding::kPt_names_to()
+//Sorts (key, value) pairs by key and sums the values of equal keys
+static void
+mergeTerms(std::vector<std::pair<uword, cx_double> > &terms)
 {
-  return lat.kPt_names_to();
+  std::sort(terms.begin(), terms.end(),
+            [](const std::pair<uword, cx_double> &x, const std::pair<uword, cx_double> &y) { return x.first < y.first; });
+  size_t  out = 0;
+  for(size_t i = 0; i < terms.size(); i++)
+  {
+    if(out > 0 && terms[out - 1].first == terms[i].first)
+    {
+      terms[out - 1].second += terms[i].second;
+    }
+    else
+    {
+      terms[out++] = terms[i];
+    }
+  }
+  terms.resize(out);
 }
 
-
-/********* Methods **********/
-cx_mat
-TightBinding::Ham(vec k)  //k in cartesian coordinates
+/*
+ * Sparse counterpart of compileHoppings for large (supercell) models. The
+ * cutoff, rounding and weights are the same, but the table is a list of
+ * nonzero hoppings (R, row, col) plus the column-major pattern of H(k),
+ * so memory goes with the number of hoppings rather than hamSize^2 per R.
+ * Kept hoppings and nonzero truncation errors are collected as flat
+ * (key, value) arrays, key = (cell * hamSize + col) * hamSize + row, and
+ * sorted and merged once at the end.
+ * Whole-block pruning is not applied here, and the error bound uses
+ * ||dT||_2 <= sqrt(||dT||_1 ||dT||_inf) per R instead of an SVD.
+ */
+void
+TightBinding::compileSparse()
 {
   int                     latDim = lat.dim(),
                           rowIndex,
                           colIndex,
-                          wsIndex = 0,
+                          deg,
                           a, b, ind, nind,
                           site;
-  vec                     coeffs(latDim);
-  cx_mat                  H(hamSize, hamSize);
-  std::complex<double>    hoppingEnergy, curr, weightedEnergy; 
-                          curr;
-  double                  cutoff = .0005;
-  
-  H.zeros();
+  uword                   N = hamSize,
+                          key;
+  const mat               &latticeVecs = latVecs();
+  std::vector<int>        cell(latDim);
+  std::map<std::vector<int>, int>       cellIndex;
+  std::vector<std::pair<uword, cx_double> > kept,   //key -> hopping
+                                            delta;  //key -> exact - kept, nonzero only
+  std::vector<uword>      position;                 //col * hamSize + row of every nonzero of H(k)
+  std::complex<double>    hoppingEnergy, exactEnergy, error;
+  bool                    keep;
   
+  keptTerms = 0;
+  totalTerms = hr_dat.n_rows;
   for(int i = 0; i < hr_dat.n_rows; i++)
   {
     rowIndex = hr_dat(i, latDim + 1) - 1;
@@ -107,152 +334,655 @@ TightBinding::Ham(vec k)  //k in cartesian coordinates
     a = ind / hamSize;
     b = ind % hamSize;
     nind = hamSize * b + a + site * (hamSize * hamSize);
+    deg = wsvec.offsets(i + 1) - wsvec.offsets(i);
     hoppingEnergy = std::complex<double>(hr_dat(nind, latDim + 2), hr_dat(nind, latDim + 3));
+    exactEnergy = hoppingEnergy / (deg * hr_weights(i / (hamSize * hamSize)));
     
-    if(abs(hoppingEnergy) > cutoff)
+    keep = abs(hoppingEnergy) > cutoff.element;
+    if(keep)
     {
-      hoppingEnergy = myRound(hoppingEnergy, cutoff);
+      keptTerms++;
+      if(cutoff.round && cutoff.element > 0)
+      {
+        hoppingEnergy = myRound(hoppingEnergy, cutoff.element);
+      }
     }
-    else
+    hoppingEnergy /= deg * hr_weights(i / (hamSize * hamSize));
+    error = exactEnergy - (keep ? hoppingEnergy : cx_double(0));
+    if(!keep && error == cx_double(0))
+    {
+      continue;
+    }
+    
+    for(int j = 0; j < deg; j++)
+    {
+      for(int l = 0; l < latDim; l++)
+      {
+        cell[l] = (int)std::lround(hr_dat(nind, l)) + wsvec.shifts(l, wsvec.offsets(i) + j);
+      }
+      
+      std::map<std::vector<int>, int>::iterator it = cellIndex.find(cell);
+      if(it == cellIndex.end())
+      {
+        it = cellIndex.insert(std::make_pair(cell, (int)cellIndex.size())).first;
+      }
+      key = (it->second * N + colIndex) * N + rowIndex;
+      if(error != cx_double(0))
+      {
+        delta.push_back(std::make_pair(key, error));
+      }
+      if(keep)
+      {
+        kept.push_back(std::make_pair(key, hoppingEnergy));
+        position.push_back(colIndex * N + rowIndex);
+      }
+    }
+  }
+  mergeTerms(kept);
+  mergeTerms(delta);
+  std::sort(position.begin(), position.end());
+  position.erase(std::unique(position.begin(), position.end()), position.end());
+  
+  //column-major sparsity pattern of H(k)
+  sp_locations.set_size(2, position.size());
+  for(size_t slot = 0; slot < position.size(); slot++)
+  {
+    sp_locations(0, slot) = position[slot] % N;
+    sp_locations(1, slot) = position[slot] / N;
+  }
+  
+  sp_pos.set_size(kept.size());
+  sp_cell.set_size(kept.size());
+  sp_vals.set_size(kept.size());
+  for(size_t slot = 0; slot < kept.size(); slot++)
+  {
+    sp_cell(slot) = kept[slot].first / (N * N);
+    sp_pos(slot) = std::lower_bound(position.begin(), position.end(), kept[slot].first % (N * N)) - position.begin();
+    sp_vals(slot) = kept[slot].second;
+  }
+  
+  hop_cells.set_size(latDim, cellIndex.size());
+  for(std::map<std::vector<int>, int>::iterator it = cellIndex.begin(); it != cellIndex.end(); ++it)
+  {
+    for(int l = 0; l < latDim; l++)
+    {
+      hop_cells(l, it->second) = it->first[l];
+    }
+  }
+  hop_R = trans(latticeVecs * conv_to<mat>::from(hop_cells));
+  
+  //row and column sums of |dT(R)| for the error bound
+  mat   rowSums(hamSize, cellIndex.size(), fill::zeros),
+        colSums(hamSize, cellIndex.size(), fill::zeros);
+  for(size_t t = 0; t < delta.size(); t++)
+  {
+    uword cellOf = delta[t].first / (N * N);
+    rowSums(delta[t].first % N, cellOf) += std::abs(delta[t].second);
+    colSums((delta[t].first / N) % N, cellOf) += std::abs(delta[t].second);
+  }
+  truncBound = 0;
+  for(uword r = 0; r < cellIndex.size(); r++)
+  {
+    truncBound += std::sqrt(max(rowSums.col(r)) * max(colSums.col(r)));
+  }
+  
+  std::cout << "Sparse hopping table: kept " << keptTerms << " of " << hr_dat.n_rows << " hoppings, "
+            << position.size() << " nonzeros per H(k) over " << cellIndex.size() << " lattice vectors\n"
+            << "Truncation error bound, max_k ||dH(k)||_2: " << truncBound << " eV\n" << std::endl;
+}
+
+/*
+ * Pairs every R of the compiled table with -R, so that
+ *   H(k)_ab = sum_{R in half} exp(ik.R) T(R)_ab + exp(-ik.R) T(-R)_ab,  a <= b,
+ * and the lower triangle follows from Hermiticity. Only the upper triangles are
+ * stored, which halves both the phases and the hopping work per k-point.
+ * The departure of the input from T(-R) = T(R)^dagger is reported here once.
+ */
+void
+TightBinding::compileHermitian()
+{
+  int                     latDim = lat.dim(),
+                          nR = hop_cells.n_cols,
+                          sign,
+                          ind = 0;
+  std::map<std::vector<int>, int> cellIndex;
+  std::vector<int>        cell(latDim),
+                          upper,    //block index of T(R), -1 if absent
+                          lower,    //block index of T(-R), -1 if absent
+                          signs;
+  mat                     diff;
+  double                  residual = 0;
+  
+  for(int r = 0; r < nR; r++)
+  {
+    for(int l = 0; l < latDim; l++)
+    {
+      cell[l] = hop_cells(l, r);
+    }
+    cellIndex[cell] = r;
+  }
+  
+  upper_ind.set_size(hamSize * (hamSize + 1) / 2);
+  for(int b = 0; b < hamSize; b++)
+  {
+    for(int a = 0; a <= b; a++)
+    {
+      upper_ind(ind++) = a + b * hamSize;
+    }
+  }
+  
+  for(int r = 0; r < nR; r++)
+  {
+    //sign of the first nonzero component decides which half R lies in
+    sign = 0;
+    for(int l = 0; l < latDim && !sign; l++)
     {
-      hoppingEnergy = std::complex<double>(0, 0);
+      sign = (hop_cells(l, r) > 0) - (hop_cells(l, r) < 0);
     }
+    for(int l = 0; l < latDim; l++)
+    {
+      cell[l] = -hop_cells(l, r);
+    }
+    std::map<std::vector<int>, int>::iterator it = cellIndex.find(cell);
+    int partner = (it == cellIndex.end()) ? -1 : it->second;
     
-    for(int j = 0; j < latDim; j++)
+    if(partner < 0)
+    {
+      diff = abs(hop_blocks.slice(r));
+    }
+    else
     {
-      coeffs(j) = hr_dat(nind, j);
+      diff = abs(hop_blocks.slice(r) - hop_blocks.slice(partner).t());
     }
+    residual = std::max(residual, diff.max());
     
-    curr = 0;
-    weightedEnergy = hoppingEnergy / (wsvec_weights(i) * hr_weights(i / pow(hamSize, 2)));
-    for(int j = 0; j < wsvec_weights(i); j++)
+    if(sign == 0)
     {
-      curr += cexp(dot(k, latVecs() * (coeffs + trans(wsvec_dat.row(wsIndex++)))));
+      upper.push_back(r);
+      lower.push_back(-1);
+      signs.push_back(1);
+    }
+    else if(sign > 0)
+    {
+      upper.push_back(r);
+      lower.push_back(partner);
+      signs.push_back(1);
+    }
+    else if(partner < 0) //-R missing from the data, R enters through the lower slot
+    {
+      upper.push_back(-1);
+      lower.push_back(r);
+      signs.push_back(-1);
     }
-    H(rowIndex, colIndex) += curr * weightedEnergy;
   }
-     
+  
+  half_R.set_size(upper.size(), latDim);
+  half_upper.zeros(upper_ind.n_elem, upper.size());
+  half_lower.zeros(upper_ind.n_elem, upper.size());
+  for(uword p = 0; p < upper.size(); p++)
+  {
+    half_R.row(p) = signs[p] * hop_R.row(upper[p] >= 0 ? upper[p] : lower[p]);
+    if(upper[p] >= 0)
+    {
+      half_upper.col(p) = hop_blocks.slice(upper[p]).elem(upper_ind);
+    }
+    if(lower[p] >= 0)
+    {
+      half_lower.col(p) = hop_blocks.slice(lower[p]).elem(upper_ind);
+    }
+  }
+  half_upper_f = conv_to<cx_fmat>::from(half_upper);
+  half_lower_f = conv_to<cx_fmat>::from(half_lower);
+  
+  std::cout << "Hermiticity residual of hopping data: " << residual << "\n" << std::endl;
+}
+
+//Unpacks an upper triangle (ordered as upper_ind) into H and mirrors it
+template<typename eT>
+void
+TightBinding::fillHermitian(const eT *packed, Mat<eT> &H) const
+{
+  uword ind = 0;
+  for(int b = 0; b < hamSize; b++)
+  {
+    for(int a = 0; a <= b; a++)
+    {
+      H(a, b) = packed[ind++];
+      if(a != b)
+      {
+        H(b, a) = std::conj(H(a, b));
+      }
+    }
+  }
+}
+
+void
+TightBinding::setHermitianFill(bool on)
+{
+  halfFill = on;
+}
+
+/*
+ * Single precision screening in plotGap (exact mode): Hamiltonians are built
+ * and diagonalised in single precision, and only gaps below refineGap are
+ * refined against the double precision H(k) (see screenGap). bandGap, and so
+ * locateWeylNodes, always works in double.
+ */
+void
+TightBinding::setMixedPrecision(bool on)
+{
+  mixedPrecision = on && !sparse;  //the single precision tables are dense
+}
+
+/*
+ * Compile-time sized kernels for Ham and bandGap where (latDim, hamSize) has
+ * one (the default); off forces the general half-table path.
+ */
+void
+TightBinding::setFixedKernels(bool on)
+{
+  fixedHamFn = NULL;
+  fixedGapFn = NULL;
+  if(on && !sparse)
+  {
+    selectFixedKernels(lat.dim(), hamSize, fixedHamFn, fixedGapFn);
+  }
+}
+
+/*
+ * plotGap follows the two middle bands from point to point with a
+ * SubspaceSolver instead of an exact eigRange solve at every point. Faster on
+ * large models, but the tracked indices are only spot checked, so exact
+ * solves stay the default.
+ */
+void
+TightBinding::setGapTracking(bool on)
+{
+  gapTracking = on;
+}
+
+/*
+ * Sparse mode: computeBands returns the n bands closest to target and
+ * bandGap the gap around target (the Fermi level), both by shift-invert.
+ */
+void
+TightBinding::setSparseTarget(double target, int n)
+{
+  sparseTarget = target;
+  sparseBands = std::max(n, 2);
+}
+
+//Worker threads used by computeBands and plotGap
+void
+TightBinding::setThreads(int n)
+{
+  numThreads = std::max(n, 1);
+}
+
+//Points between exact phase evaluations along a straight k-path
+void
+TightBinding::setPhaseReseed(int n)
+{
+  phaseReseed = std::max(n, 1);
+}
+
+//textOutput, binaryOutput or both, for computeBands and plotGap
+void
+TightBinding::setOutputFormat(int format)
+{
+  outputFormat = (format & (textOutput | binaryOutput)) ? format : textOutput;
+}
+
+//exp(ik.R) for every hopping block
+cx_vec
+TightBinding::phases(const vec &k) const
+{
+  vec     kR = hop_R * k;
+  cx_vec  rVal(kR.n_elem);
+  
+  cexp(kR.memptr(), rVal.memptr(), kR.n_elem);
+  return rVal;
+}
+
+//Sparse H(k); from the sparse table in sparse mode, from the dense H otherwise
+sp_cx_mat
+TightBinding::HamSparse(const vec &k) const  //k in cartesian coordinates
+{
+  if(!sparse)
+  {
+    return sp_cx_mat(Ham(k));
+  }
+  
+  cx_vec  phase = phases(k),
+          values(sp_locations.n_cols, fill::zeros);
+  for(uword t = 0; t < sp_vals.n_elem; t++)
+  {
+    values(sp_pos(t)) += sp_vals(t) * phase(sp_cell(t));
+  }
+  return sp_cx_mat(sp_locations, values, hamSize, hamSize, false, false);
+}
+
+/********** Methods from Lattice **********/
+
+const mat&
+TightBinding::latVecs() const
+{
+  return lat.latticeVectors();
+}
+
+const mat&
+TightBinding::kVecs() const
+{
+  return lat.kVectors();
+}
+
+const cube&
+TightBinding::kPoints() const
+{
+  return lat.kPoints();
+}
+
+const std::vector<std::string>&
+TightBinding::kPt_names_from() const
+{
+  return lat.kPt_names_from();
+}
+
+const std::vector<std::string>&
+TightBinding::kPt_names_to() const
+{
+  return lat.kPt_names_to();
+}
+
+const imat&
+TightBinding::hoppingCells() const
+{
+  return hop_cells;
+}
+
+const cx_cube&
+TightBinding::hoppingBlocks() const
+{
+  return hop_blocks;
+}
+
+
+/********* Methods **********/
+cx_mat
+TightBinding::Ham(const vec &k) const  //k in cartesian coordinates
+{
+  static thread_local HamScratch scratch;
+  cx_mat                  H;
+  
+  Ham(k, H, scratch);
   return H;
 }
 
+/*
+ * H(k) into H, using the caller's scratch buffers. Once H and scratch have
+ * been sized by a first call, the dense paths do not touch the heap: the
+ * products go straight into the existing buffers (BLAS gemv, beta = 1 for
+ * the second half-table term) and the full table is viewed as one
+ * hamSize^2 x nR matrix rather than sliced. Sparse mode still allocates.
+ */
+void
+TightBinding::Ham(const vec &k, cx_mat &H, HamScratch &scratch) const
+{
+  if(sparse)
+  {
+    H = cx_mat(HamSparse(k));
+    return;
+  }
+  H.set_size(hamSize, hamSize);
+  
+  if(halfFill && fixedHamFn)
+  {
+    fixedHamFn(half_R.memptr(), half_upper.memptr(), half_lower.memptr(), half_R.n_rows, k.memptr(), H.memptr());
+    return;
+  }
+  if(halfFill)
+  {
+    scratch.kR = half_R * k;
+    scratch.phase.set_size(scratch.kR.n_elem);
+    cexp(scratch.kR.memptr(), scratch.phase.memptr(), scratch.kR.n_elem);
+    scratch.conjPhase.set_size(scratch.kR.n_elem);
+    for(uword r = 0; r < scratch.kR.n_elem; r++)
+    {
+      scratch.conjPhase(r) = std::conj(scratch.phase(r));
+    }
+    scratch.packed = half_upper * scratch.phase;
+    scratch.packed += half_lower * scratch.conjPhase;
+    fillHermitian(scratch.packed.memptr(), H);
+    return;
+  }
+  
+  scratch.kR = hop_R * k;
+  scratch.phase.set_size(scratch.kR.n_elem);
+  cexp(scratch.kR.memptr(), scratch.phase.memptr(), scratch.kR.n_elem);
+  
+  //sum_R T(R) e^{ik.R} as a single product, without temporaries
+  const cx_mat  blocks(const_cast<cx_double *>(hop_blocks.memptr()), hamSize * hamSize, hop_blocks.n_slices, false, true);
+  cx_vec        flatH(H.memptr(), H.n_elem, false, true);
+  flatH = blocks * scratch.phase;
+}
+
+/*
+ * H(k) for every column of kpts (cartesian coordinates) at once. The phases
+ * exp(ik.R) for all (R, k) pairs form an nR x nK matrix, and the stacked
+ * hopping blocks (hamSize^2 x nR) times that matrix gives all Hamiltonians
+ * in a single complex matrix product. Slice i of the result is H(kpts.col(i)).
+ * With the Hermitian fill this is two half-size products on the packed table.
+ */
 cx_cube
-TightBinding::expandHam_order1(vec k)  //k in cartesian coordinates
+TightBinding::HamBatch(const mat &kpts) const
 {
-  int                     latDim = lat.dim(),
-                          rowIndex,
-                          colIndex,
-                          wsIndex = 0,
-                          a, b, ind, nind,
-                          site;
-  vec                     coeffs(latDim),
-                          R;
-                          //k = k0 * (1 + .0001);
-  cx_vec                  curr(latDim);
-  cx_cube                 H_1(hamSize, hamSize, latDim);
-  std::complex<double>    hoppingEnergy, wf_multiplier, weightedEnergy;
-  double                  cutoff = .0005;
+  if(sparse)
+  {
+    cx_cube   H(hamSize, hamSize, kpts.n_cols);
+    for(uword i = 0; i < kpts.n_cols; i++)
+    {
+      H.slice(i) = cx_mat(HamSparse(kpts.col(i)));
+    }
+    return H;
+  }
   
-  H_1.zeros();
-    
-  for(int i = 0; i < hr_dat.n_rows; i++)
+  const mat   &R = halfFill ? half_R : hop_R;
+  mat         kR = R * kpts;
+  cx_mat      phase(kR.n_rows, kR.n_cols);
+  
+  cexp(kR.memptr(), phase.memptr(), kR.n_elem);
+  return HamFromPhases(phase);
+}
+
+/*
+ * Single precision HamBatch, always from the Hermitian half table. Accurate
+ * to ~1e-7 relative, enough for screening; phases are still computed in
+ * double.
+ */
+cx_fcube
+TightBinding::HamBatchSingle(const mat &kpts) const
+{
+  mat         kR = half_R * kpts;
+  cx_mat      phase(kR.n_rows, kR.n_cols);
+  
+  cexp(kR.memptr(), phase.memptr(), kR.n_elem);
+  
+  cx_fmat     phaseF = conv_to<cx_fmat>::from(phase),
+              packed = half_upper_f * phaseF + half_lower_f * conj(phaseF);
+  cx_fcube    H(hamSize, hamSize, kpts.n_cols);
+  for(uword i = 0; i < kpts.n_cols; i++)
   {
-    rowIndex = hr_dat(i, latDim + 1) - 1;
-    colIndex = hr_dat(i, latDim) - 1;
-    site = i / (hamSize * hamSize);
-    ind = i % (hamSize * hamSize);
-    a = ind / hamSize;
-    b = ind % hamSize;
-    nind = hamSize * b + a + site * (hamSize * hamSize);
-    hoppingEnergy = std::complex<double>(hr_dat(nind, latDim + 2), hr_dat(nind, latDim + 1));
-      
-    if(abs(hoppingEnergy) > cutoff)
+    fillHermitian(packed.colptr(i), H.slice(i));
+  }
+  return H;
+}
+
+//H(k0 + j * dk) for j = 0 ... count - 1
+cx_cube
+TightBinding::HamPath(const vec &k0, const vec &dk, int count) const
+{
+  if(sparse)
+  {
+    mat       kpts(k0.n_elem, count);
+    for(int j = 0; j < count; j++)
     {
-      hoppingEnergy = myRound(hoppingEnergy, cutoff);
+      kpts.col(j) = k0 + j * dk;
+    }
+    return HamBatch(kpts);
+  }
+  
+  cx_mat      phase((halfFill ? half_R : hop_R).n_rows, count);
+  
+  pathPhases(k0, dk, count, phase.memptr());
+  return HamFromPhases(phase);
+}
+
+/*
+ * Phases exp(ik.R) of the active hopping table (half or full) at the points
+ * k0 + j * dk, j < count, written column by column to out. Each column is the
+ * previous one times exp(i dk.R), so only the seeds need sin/cos; every
+ * phaseReseed points the column is recomputed exactly to stop the rounding
+ * error of the recurrence from building up.
+ */
+void
+TightBinding::pathPhases(const vec &k0, const vec &dk, int count, cx_double *out) const
+{
+  const mat   &R = halfFill ? half_R : hop_R;
+  uword       nR = R.n_rows;
+  vec         kR = R * dk;
+  cx_vec      step(nR);
+  
+  cexp(kR.memptr(), step.memptr(), nR);
+  for(int j = 0; j < count; j++)
+  {
+    cx_double   *col = out + j * nR;
+    if(j % phaseReseed == 0)
+    {
+      kR = R * (k0 + j * dk);
+      cexp(kR.memptr(), col, nR);
     }
     else
     {
-      hoppingEnergy = std::complex<double>(0, 0);
+      const cx_double   *prev = col - nR;
+      for(uword r = 0; r < nR; r++)
+      {
+        col[r] = prev[r] * step(r);
+      }
     }
-      
-    for(int j = 0; j < latDim; j++)
+  }
+}
+
+//H(k) for every column of phase, laid out as the active table expects
+cx_cube
+TightBinding::HamFromPhases(const cx_mat &phase) const
+{
+  uword                   nR = hop_blocks.n_slices,
+                          nK = phase.n_cols,
+                          blockSize = hamSize * hamSize;
+  cx_cube                 H(hamSize, hamSize, nK);
+  
+  if(halfFill)
+  {
+    cx_mat  packed = half_upper * phase + half_lower * conj(phase);
+    for(uword i = 0; i < nK; i++)
     {
-      coeffs(j) = hr_dat(nind, j);
+      fillHermitian(packed.colptr(i), H.slice(i));
     }
-      
-    curr.zeros();
-    weightedEnergy = hoppingEnergy / (wsvec_weights(i) * hr_weights(i / pow(hamSize, 2)));
-    for(int j = 0; j < wsvec_weights(i); j++)
+    return H;
+  }
+  
+  cx_mat                  blocks(const_cast<cx_double *>(hop_blocks.memptr()), blockSize, nR, false, true), //read only
+                          stacked(H.memptr(), blockSize, nK, false, true);
+  
+  stacked = blocks * phase;
+  return H;
+}
+
+/*
+ * H(k) and all of its k-derivatives up to the given order from one set of
+ * phases. Element n of the result holds the n-th derivatives, one slice per
+ * nondecreasing index tuple of symmetricIndices(latDim, n); for n = 2 that
+ * is the 6 independent slices d2H/dk_a dk_b, a <= b (see symIndex). Element
+ * 0 holds H itself as a single slice.
+ */
+std::vector<cx_cube>
+TightBinding::HamDerivatives(const vec &k, int order) const  //k in cartesian coordinates
+{
+  std::vector<cx_cube>  rVal;
+  HamScratch            scratch;
+  
+  HamDerivatives(k, order, rVal, scratch);
+  return rVal;
+}
+
+//The same, written into out; cubes already of the right size are reused
+void
+TightBinding::HamDerivatives(const vec &k, int order, std::vector<cx_cube> &out, HamScratch &scratch) const
+{
+  if(sparse)
+  {
+    throw "method TightBinding::HamDerivatives : not available for the sparse table";
+  }
+  std::vector<umat>       indices(order + 1);
+  std::complex<double>    iPow, coeff;
+  
+  scratch.kR = hop_R * k;
+  scratch.phase.set_size(scratch.kR.n_elem);
+  cexp(scratch.kR.memptr(), scratch.phase.memptr(), scratch.kR.n_elem);
+  
+  out.resize(order + 1);
+  for(int n = 0; n <= order; n++)
+  {
+    indices[n] = symmetricIndices(lat.dim(), n);
+    out[n].zeros(hamSize, hamSize, indices[n].n_cols);
+  }
+  
+  for(uword r = 0; r < hop_blocks.n_slices; r++)
+  {
+    const cx_mat  block(const_cast<cx_double *>(hop_blocks.slice_memptr(r)), hamSize, hamSize, false, true);
+    iPow = 1;
+    for(int n = 0; n <= order; n++)
     {
-      R = latVecs() * (coeffs + trans(wsvec_dat.row(wsIndex++)));
-      wf_multiplier = cexp(dot(k, R)) * weightedEnergy;
-      H_1.tube(rowIndex, colIndex) += wf_multiplier * I * R;
+      for(uword c = 0; c < indices[n].n_cols; c++)
+      {
+        coeff = scratch.phase(r) * iPow;
+        for(int l = 0; l < n; l++)
+        {
+          coeff *= hop_R(r, indices[n](l, c));
+        }
+        out[n].slice(c) += coeff * block;
+      }
+      iPow *= I;
     }
   }
-  
-  return H_1;
 }
 
 cx_cube
-TightBinding::expandHam_order2(vec k)
+TightBinding::expandHam_order1(const vec &k) const  //k in cartesian coordinates
+{
+  return HamDerivatives(k, 1)[1];
+}
+
+cx_cube
+TightBinding::expandHam_order2(const vec &k) const
 {
   if(lat.dim() != 3)
   {
     throw "method TightBinding::expandHam : lattice must be of dimension 3";
   }
-  int                     latDim = lat.dim(),
-                          rowIndex,
-                          colIndex,
-                          wsIndex = 0,
-                          a, b, ind, newInd,
-                          site;
-  vec                     coeffs(latDim),
-                          R;
-                          //k = k0 * (1 + .0001);
-  cx_vec                  curr(latDim);
+  int                     latDim = lat.dim();
   cx_cube                 H_2(hamSize, hamSize, pow(latDim, 2));
-  std::complex<double>    hoppingEnergy, wf_multiplier, weightedEnergy;
-  double                  cutoff = .0005;
+  cx_vec                  phase = phases(k);
   
   H_2.zeros();
     
-  for(int i = 0; i < hr_dat.n_rows; i++)
+  for(uword r = 0; r < hop_blocks.n_slices; r++)
   {
-    rowIndex = hr_dat(i, latDim + 1) - 1;
-    colIndex = hr_dat(i, latDim) - 1;
-    site = i / (hamSize * hamSize);
-    ind = i % (hamSize * hamSize);
-    a = ind / hamSize;
-    b = ind % hamSize;
-    newInd = hamSize * b + a + site * (hamSize * hamSize);
-    hoppingEnergy = std::complex<double>(hr_dat(newInd, latDim + 2), hr_dat(newInd, latDim + 1));
-      
-    if(abs(hoppingEnergy) > cutoff)
-    {
-      hoppingEnergy = myRound(hoppingEnergy, cutoff);
-    }
-    else
-    {
-      hoppingEnergy = std::complex<double>(0, 0);
-    }
-      
-    for(int j = 0; j < latDim; j++)
-    {
-      coeffs(j) = hr_dat(newInd, j);
-    }
-      
-    curr.zeros();
-    weightedEnergy = hoppingEnergy / (wsvec_weights(i) * hr_weights(i / pow(hamSize, 2)));
-    for(int j = 0; j < wsvec_weights(i); j++)
+    for(int m = 0; m < latDim; m++)
     {
-      R = latVecs() * (coeffs + trans(wsvec_dat.row(wsIndex++)));
-      wf_multiplier = cexp(dot(k, R)) * weightedEnergy;
-      
-      for(int m = 0; m < latDim; m++)
+      for(int n = 0; n < latDim; n++)
       {
-	for(int n = 0; n < latDim; n++)
-	{
-	  H_2(rowIndex, colIndex, m * latDim + n) += wf_multiplier * R(m) * R(n);
-	}
+        H_2.slice(m * latDim + n) += (phase(r) * hop_R(r, m) * hop_R(r, n)) * hop_blocks.slice(r);
       }
     }
   }
@@ -261,12 +991,17 @@ TightBinding::expandHam_order2(vec k)
 }
 
 
+/*
+ * Writes the band structure along the k-path of the .win file. If a finite
+ * window [eMin, eMax] (eV) is given only the bands inside it are computed,
+ * following them along the path with a warm-started subspace solver.
+ */
 int
-TightBinding::computeBands()
+TightBinding::computeBands(double eMin, double eMax) const
 {
   std::string     path = "../data/" + seedname;
-  std::ofstream   EnergyOut (path + "_bands.dat"),
-                  GnuOut (path + "_bands.gnu");
+  std::ofstream   GnuOut;
+  std::unique_ptr<TextWriter> EnergyOut;
   mat             kPointsFrom = kVecs() * kPoints().slice(0),
                   kPointsTo   = kVecs() * kPoints().slice(1);
   std::vector<std::string> kPtNamesFrom = kPt_names_from(),
@@ -274,49 +1009,182 @@ TightBinding::computeBands()
   unsigned        numOfKPts = kPointsTo.n_cols;
   int             lineDensity = 600 / (numOfKPts - 1), 			
                   numOfRows = 0,
-                  numOfCols = 0;
+                  numOfCols = 0,
+                  batchSize = 64;
   double          pointCount = 0, 	//keeps track of how many points have been plotted in total.
                   sliceSize,			//keeps track of current slice of k-space.
                   maxEnergy = 0,
                   minEnergy = 0;
   vec             symPoints(numOfKPts);
+  bool            window = eMin > -datum::inf || eMax < datum::inf;
+  std::vector<vec>    pathPts,
+                      pathSteps,
+                      bands;
+  std::vector<double> xs;
+  std::vector<int>    segment,  //index into pathSteps of each point
+                      bandStart;  //band index of the first value in bands, per point
     
   std::cout << "Calculating energy eigenvalues\n" << "...\n" << std::endl;
     
   for(int currentPoint = 1; currentPoint < numOfKPts; currentPoint++)
   {
     vec         pathToNext = kPointsTo.col(currentPoint) - kPointsFrom.col(currentPoint - 1),
-                pathFrom = kPointsFrom.col(currentPoint - 1),
-                k,
-                energies;
+                pathFrom = kPointsFrom.col(currentPoint - 1);
     double      mult;
        
     sliceSize = norm(pathToNext);
     pointCount += sliceSize;
+    pathSteps.push_back(pathToNext / (lineDensity * sliceSize));
     for(int point = (pointCount - sliceSize) * lineDensity; point <= pointCount * lineDensity; point++)
     {
       mult = (double)(point - (pointCount - sliceSize) * lineDensity) / (lineDensity * (sliceSize));
-      k = pathFrom + mult * pathToNext;
-            
-      cx_mat H = Ham(k);
-      eig_sym( energies, H );
-            
+      pathPts.push_back(pathFrom + mult * pathToNext);
+      segment.push_back(currentPoint - 1);
+      xs.push_back((double)(point) / lineDensity);
+    }
+    symPoints(currentPoint - 1) = pointCount - sliceSize;
+  }
+  symPoints(numOfKPts - 1) = pointCount;
+  
+  /*
+   * Batches of batchSize consecutive k-points are handed out to the threads in
+   * path order and written as soon as all earlier batches are done, so the
+   * output is identical to a serial run. Each thread keeps its own tracker,
+   * but every batch starts it afresh (and seeds the shift-invert block from
+   * the batch index), so the results depend only on the fixed batch
+   * boundaries and not on which thread ran which batch.
+   * Within a batch the phases are stepped along each straight segment
+   * (pathPhases) rather than evaluated point by point.
+   */
+  int                         numPoints = pathPts.size(),
+                              numBatches = (numPoints + batchSize - 1) / batchSize;
+  std::vector<SubspaceSolver> trackers(numThreads, SubspaceSolver(eMin, eMax));
+  std::vector<cx_mat>         sparseBlocks(numThreads);  //shift-invert iteration blocks
+  
+  bands.resize(numPoints);
+  bandStart.assign(numPoints, 0);
+  TaskPool pool(numBatches, numThreads, [&](int batch, int thread)
+  {
+    int       first = batch * batchSize,
+              last = std::min(first + batchSize, numPoints) - 1;
+    
+    trackers[thread].reset();
+    if(sparse)
+    {
+      sparseBlocks[thread] = startBlock(hamSize, sparseBands, batch);
+      for(int p = first; p <= last; p++)
+      {
+        bands[p] = eigsNear(HamSparse(pathPts[p]), sparseBands, sparseTarget, sparseBlocks[thread]);
+        if(window)
+        {
+          bands[p] = bands[p].elem(find((bands[p] > eMin) && (bands[p] <= eMax)));
+        }
+      }
+      return;
+    }
+    
+    cx_mat    phase((halfFill ? half_R : hop_R).n_rows, last - first + 1);
+    for(int p = first, run; p <= last; p += run)
+    {
+      run = 1;
+      while(p + run <= last && segment[p + run] == segment[p])
+      {
+        run++;
+      }
+      pathPhases(pathPts[p], pathSteps[segment[p]], run, phase.colptr(p - first));
+    }
+    cx_cube   H = HamFromPhases(phase);
+    
+    for(int p = first; p <= last; p++)
+    {
+      if(window)
+      {
+        bands[p] = trackers[thread].solve(H.slice(p - first));
+        bandStart[p] = trackers[thread].firstIndex();
+      }
+      else
+      {
+        eig_sym( bands[p], H.slice(p - first) );
+      }
+    }
+  });
+  
+  if(outputFormat & textOutput)
+  {
+    EnergyOut.reset(new TextWriter(path + "_bands.dat"));
+  }
+  for(int batch = 0; batch < numBatches; batch++)
+  {
+    pool.wait(batch);
+    for(int p = batch * batchSize; p < std::min((batch + 1) * batchSize, numPoints); p++)
+    {
+      vec &energies = bands[p];
       for(int eigNum = 0; eigNum < energies.n_rows; eigNum++)
       {
         if (energies(eigNum) > maxEnergy) maxEnergy = energies(eigNum);
         if (energies(eigNum) < minEnergy) minEnergy = energies(eigNum);
-        EnergyOut << std::setprecision(16) << (double)(point) / lineDensity
-                  << "      " << energies(eigNum) << std::endl;
+        if(EnergyOut)
+        {
+          EnergyOut->field(xs[p]);
+          EnergyOut->field(energies(eigNum));
+          EnergyOut->endRow();
+        }
       }
     }
-    symPoints(currentPoint - 1) = pointCount - sliceSize;
   }
-  symPoints(numOfKPts - 1) = pointCount;
+  if(EnergyOut)
+  {
+    EnergyOut->flush();
+  }
     
     /************************** Setting Output ***************************/
+  
+  /*
+   * One column per band index, NaN where the band is outside the window at
+   * that point. Shift-invert (sparse) results carry no global band index:
+   * their columns are positions among the returned bands, labelled -1.
+   */
+  if(outputFormat & binaryOutput)
+  {
+    int         lowest = sparse ? 0 : hamSize,
+                highest = 0;
+    for(int p = 0; p < numPoints; p++)
+    {
+      if(!bands[p].is_empty() && !sparse)
+      {
+        lowest = std::min(lowest, bandStart[p]);
+      }
+      highest = std::max(highest, (sparse ? 0 : bandStart[p]) + (int)bands[p].n_elem);
+    }
+    lowest = std::min(lowest, highest);
+    
+    mat         k(lat.dim(), numPoints),
+                E(numPoints, highest - lowest);
+    Col<sword>  index(highest - lowest);
+    E.fill(datum::nan);
+    for(int p = 0; p < numPoints; p++)
+    {
+      k.col(p) = pathPts[p];
+      for(uword b = 0; b < bands[p].n_elem; b++)
+      {
+        E(p, (sparse ? 0 : bandStart[p] - lowest) + b) = bands[p](b);
+      }
+    }
+    for(uword c = 0; c < index.n_elem; c++)
+    {
+      index(c) = sparse ? -1 : lowest + (sword)c;
+    }
+    std::cout << "Writing Output to file" << path << "_bands.tbcol" << "\n" << "...\n" << std::endl;
+    writeColumns(path + "_bands.tbcol", k, index, E);
+  }
+  if(!(outputFormat & textOutput))
+  {
+    return 1;
+  }
     
   std::cout << "Writing Output to file" << path << "_bands.dat" << "\n" << "...\n" << std::endl;
     
+  GnuOut.open(path + "_bands.gnu");
   GnuOut << "set terminal png" << '\n' << "set output '" << seedname << "_bands.png'" << std::endl;
   GnuOut << "unset arrow" 			<< std::endl;
   GnuOut << "set style data dots"	 	<< std::endl;
@@ -392,29 +1260,67 @@ double Hartman(vec x)
 */
 
 double
-TightBinding::bandGap(vec k) //k in cartesian coordinates
+TightBinding::bandGap(const vec &k) const //k in cartesian coordinates
 {
-  vec         energies;
-  
-  cx_mat      H = Ham(k);
-  int         len;
-  double      rVal = 0;
+  if(halfFill && fixedGapFn)
+  {
+    return fixedGapFn(half_R.memptr(), half_upper.memptr(), half_lower.memptr(), half_R.n_rows, k.memptr());
+  }
+  if(sparse)
+  {
+    cx_mat  X;
+    vec     energies = eigsNear(HamSparse(k), sparseBands, sparseTarget, X);
+    uvec    below = find(energies <= sparseTarget),
+            above = find(energies > sparseTarget);
+    if(below.is_empty() || above.is_empty())
+    {
+      throw "method TightBinding::bandGap : no bands on both sides of the sparse target";
+    }
+    return energies(above(0)) - energies(below(below.n_elem - 1));
+  }
+  return gapFromHam(Ham(k));
+}
+
+#define refineGap 1e-2  //eV; smaller single precision gaps are refined in double
 
-  eig_sym( energies, H );
-  energies = mergeSort(energies);
+/*
+ * Gap between the two middle bands of the single precision Hf = H(k), k in
+ * cartesian coordinates, by cheevr. Small gaps, where the single precision
+ * error (~1e-5 eV) matters relative to the gap, are refined by a
+ * Rayleigh-Ritz step on the two eigenvectors with the double precision H(k),
+ * which squares the error of the vectors.
+ */
+double
+TightBinding::screenGap(const cx_fmat &Hf, const vec &k) const
+{
+  int         len = Hf.n_rows;
+  cx_fmat     Uf;
+  fvec        energies = eigRange(Hf, len / 2 - 1, len / 2, &Uf);
   
-  //H.print();
-  //energies.print();
-  //std::cout << std::endl;
+  if(energies(1) - energies(0) >= refineGap)
+  {
+    return energies(1) - energies(0);
+  }
+  cx_mat      Q = orth(conv_to<cx_mat>::from(Uf)),
+              G = Q.t() * Ham(k) * Q;
+  vec         refined = eig_sym(cx_mat(.5 * (G + G.t())));
   
-  len = energies.size();
-  rVal = energies(len / 2) - energies(len / 2 - 1);
-  return rVal;
+  return refined(1) - refined(0);
+}
+
+//Gap between the two middle bands; only those two eigenvalues are computed
+double
+TightBinding::gapFromHam(const cx_mat &H) const
+{
+  int         len = H.n_rows;
+  vec         energies = eigRange(H, len / 2 - 1, len / 2);
+  
+  return energies(1) - energies(0);
 }
 
 
 vec
-TightBinding::locateWeylNodes(vec k) //w in lattice coordinates
+TightBinding::locateWeylNodes(const vec &k) const //w in lattice coordinates
 {
   if(k.size() != lat.dim())
   {
@@ -568,13 +1474,14 @@ TightBinding::locateWeylNodes(vec k) //w in lattice coordinates
 
 
 cx_mat
-TightBinding::fermiVelocity(vec k0)  //k in lattice coordinates
+TightBinding::fermiVelocity(const vec &k0) const  //k in lattice coordinates
 {
   vec       k = kVecs() * k0,
             energies;
-  cx_mat    H_0 = Ham(k),
+  std::vector<cx_cube> dH = HamDerivatives(k, 1);
+  cx_mat    H_0 = dH[0].slice(0),
             U;
-  cx_cube   H_1 = expandHam_order1(k);
+  cx_cube   H_1 = dH[1];
   
   eig_sym(energies, U, H_0);
   
@@ -621,215 +1528,365 @@ TightBinding::fermiVelocity(vec k0)  //k in lattice coordinates
 
 
 
-//could also do monte-carlo integration
+/*
+ * Indices [first, last) of the sorted frequency grid within the reach of a
+ * Gaussian delta(hBar (w - omega), alpha) centred on w, i.e. where the
+ * Gaussian is above cutoff.
+ */
+static void
+deltaWindow(const vec &omegas, double w, double alpha, double cutoff, uword &first, uword &last)
+{
+  double  reach = std::sqrt(-std::log(cutoff)) / (alpha * hBar);
+  first = std::lower_bound(omegas.begin(), omegas.end(), w - reach) - omegas.begin();
+  last = std::upper_bound(omegas.begin(), omegas.end(), w + reach) - omegas.begin();
+}
+
+static void
+checkFrequencies(const vec &omegas)
+{
+  if(omegas.is_empty() || !omegas.is_sorted())
+  {
+    throw "photocurrent spectrum: frequencies must be a non-empty ascending grid";
+  }
+}
+
+//Injection current at one frequency
 vec
-TightBinding::injectionCurrent(double omega, vec A, double T)
+TightBinding::injectionCurrent(double omega, vec A, double T) const
+{
+  vec omegas(1);
+  omegas(0) = omega;
+  return injectionSpectrum(omegas, A, T).col(0);
+}
+
+//Injection current for the (real) field A at every frequency of omegas
+mat
+TightBinding::injectionSpectrum(const vec &omegas, const vec &A, double T) const
+{
+  return injectionTensor(omegas, T).realCurrent(conv_to<cx_vec>::from(A));
+}
+
+/*
+ * Injection tensor eta(a, b, c) = sum_k dGap/dk_a v_b conj(v_c) df delta for
+ * every frequency of the ascending grid omegas, from a single pass over the
+ * k-mesh, with v = <hi| dH/dk |lo> between the two middle bands. H and dH/dk
+ * for the whole mesh come from one FFT pass (HamMesh, order 1); only the two
+ * middle eigenpairs are computed, and the gap gradient is Hellmann-Feynman,
+ * v_hh - v_ll. Each point then only adds to the frequencies its Gaussian
+ * delta reaches (weights below the cutoff are never evaluated). The
+ * polarisation enters only through ResponseTensor::current.
+ */
+//could also do monte-carlo integration
+ResponseTensor
+TightBinding::injectionTensor(const vec &omegas, double T) const
 {
   if(lat.dim() != 3)
   {
     throw "method TightBinding::phCurrent : lattice must be of dimension 3";
   }
+  checkFrequencies(omegas);
   
   std::cout << "Attempting to calculate photocurrent."
   << "\n...\n" << std::endl;
 
   
-  cx_cube               H_1;
-  vec                   k(lat.dim()),
-                        energies,
-                        sum(k.size()),
-                        tmp = k,
-                        grad(k.size());
-  int                   slices = 4;
-  double                delta,
+  int                   latDim = lat.dim(),
+                        slices = 4,
+                        lo = hamSize / 2 - 1,
+                        hi = hamSize / 2;
+  cx_cube               eta(latDim, latDim * latDim, omegas.n_elem, fill::zeros);
+  vec                   energies,
+                        grad(latDim);
+  cx_vec                V(latDim);
+  cx_mat                U,    //eigenvectors of bands lo and hi
+                        VV;   //(b, c) -> v_b conj(v_c)
+  double                gap, weight,
                         Ef = 15.2886, //eV
                         alpha = 25,
                         volume = std::abs(det(kVecs())),
-                        f_l, f_s, h = .00001;
-  std::complex<double>  V = 0;
+                        cutoff = .0000000000000001;
+  uword                 first, last;
   
-  //define mesh in k-space
+  //define mesh in k-space; H(k) and dH/dk for the whole mesh come from one FFT pass
+  HamMesh               mesh(*this, slices, slices, slices, 1);
+  int                   count = 0;
   
-  for(int i = 1; i <= slices; i++)
+  while(mesh.next())
   {
-    for(int j = 1; j <= slices; j++)
+    if(!(count++ % (slices * slices * 10)))
     {
-      for(int l = 1; l <= slices; l++)
+      std::cout << count - 1 << " out of " << mesh.size() << std::endl;
+    }
+    
+    energies = eigRange(mesh.H(), lo, hi, &U);
+    gap = energies(1) - energies(0);
+    deltaWindow(omegas, gap / hBar, alpha, cutoff, first, last);
+    if(first == last)
+    {
+      continue;
+    }
+    
+    //gap gradient (Hellmann-Feynman) and transition amplitudes in the eigenbasis
+    const cx_vec  u_lo(const_cast<cx_double *>(U.colptr(0)), hamSize, false, true),
+                  u_hi(const_cast<cx_double *>(U.colptr(1)), hamSize, false, true);
+    for(int m = 0; m < latDim; m++)
+    {
+      const cx_mat  &dH = mesh.dH().slice(m);
+      grad(m) = std::real(cdot(u_hi, dH * u_hi) - cdot(u_lo, dH * u_lo));
+      V(m) = cdot(u_hi, dH * u_lo);
+    }
+    VV = V * V.t();
+    weight = fermiDirac(energies(0), Ef, T) - fermiDirac(energies(1), Ef, T);
+
+    //Use narrow Gaussian as delta function
+    for(uword i = first; i < last; i++)
+    {
+      double  w = weight * delta(gap - hBar * omegas(i), alpha);
+      for(uword bc = 0; bc < VV.n_elem; bc++)
       {
-        if(!(i - 1 % 10) && j - 1 == 0 && l - 1 == 0)
-        {
-          std::cout << (i - 1) * pow(slices, 2) + (j - 1) * slices + l - 1 << " out of " << pow(slices, 3) << std::endl;
-        }
-        
-        k << i << j << l;
-        k = kVecs() * k / slices;
-        
-        eig_sym(energies, Ham(k));
-        
-        //obtain deriv of bandGap using numerical approximation
-        for(int m = 0; m < k.size(); m++)
-        {
-          tmp(m) += h;
-          f_l = bandGap(tmp);
-          tmp(m) -= 2 * h;
-          f_s = bandGap(tmp);
-          grad(m) = (f_l - f_s);    //Second order error
-        }
-        
-        //obtain transition amplitudes/matrix elements
-        H_1 = expandHam_order1(k);
-      
-        for(int m = 0; m < A.size() * (A.size() < lat.dim()) +  lat.dim() * (lat.dim() <= A.size()); m++)
+        for(int a = 0; a < latDim; a++)
         {
-          V += H_1(16, 15, m) * A(m);
+          eta(a, bc, i) += grad(a) * w * VV(bc);
         }
-
-        //Use narrow Gaussian as delta function
-        delta = exp(std::pow(alpha * (bandGap(k) - hBar * omega), 2));
-        
-        sum += grad * norm(V) * norm(V) * delta * (fermiDirac(energies(15), Ef, T) -fermiDirac(energies(16), Ef, T));
       }
     }
   }
   std::cout << std::endl;
-  return sum * volume / (pow(slices, lat.dim()) * hBar * h * 2);
+  eta *= volume / (pow(slices, latDim) * hBar);
+  return ResponseTensor(omegas, eta);
   
   //need to convert units
 }
 
+//X.slice(i) <- U^+ X.slice(i) U for every slice, through one product buffer
+static void
+rotateSlices(cx_cube &X, const cx_mat &U, cx_mat &tmp)
+{
+  for(uword i = 0; i < X.n_slices; i++)
+  {
+    tmp = X.slice(i) * U;
+    X.slice(i) = U.t() * tmp;
+  }
+}
+
+/*
+ * Work space for one thread of shiftCurrent, kept for a whole integration.
+ * The velocity matrices come from the k-mesh and are rotated into the
+ * eigenbasis in place (rotated is the product buffer).
+ */
+struct ShiftWorkspace
+{
+  cx_cube               r,          //interband position
+                        r_k,        //its generalised derivative, slice p + dim * a
+                        d,          //v_pp - v_qq
+                        susceptibility; //(a, b + dim c, omega)
+  cx_mat                U,
+                        rotated,
+                        invGap;     //1 / (E_p - E_q), 0 where masked
+  vec                   energies,
+                        weights;    //Gaussian weight of each frequency for the current pair
+  long                  zeroPairs;  //occupied-empty pairs with w_mn == 0
+};
+
+/*
+ * Interband position r and its generalised derivative r_k (slice
+ * p + latDim * a) from ws.energies and the velocity matrices v, already in
+ * the eigenbasis:
+ * r^p_{;a} = (-(r^p d^a + r^a d^p) - [v^p, r^a]) elementwise over hBar / (E_i - E_j).
+ * The commutator is two gemms into the product buffer. The second
+ * derivative term of r_k is left out.
+ */
+static void
+buildPosition(const cx_cube &v, ShiftWorkspace &ws, int latDim)
+{
+  int           hamSize = v.n_rows;
+  
+  ws.r.set_size(hamSize, hamSize, latDim);
+  ws.r_k.set_size(hamSize, hamSize, latDim * latDim);
+  ws.d.set_size(hamSize, hamSize, latDim);
+  ws.invGap.set_size(hamSize, hamSize);
+  
+  //1 / (E_p - E_q), masked to zero on the diagonal and for degenerate pairs
+  for(int q = 0; q < hamSize; q++)
+  {
+    for(int p = 0; p < hamSize; p++)
+    {
+      double  gap = ws.energies(p) - ws.energies(q);
+      ws.invGap(p, q) = (p != q && std::abs(gap) > degenerateGap) ? 1 / gap : 0;
+    }
+  }
+  for(int a = 0; a < latDim; a++)
+  {
+    ws.r.slice(a) = -I * (v.slice(a) % ws.invGap);
+    for(int q = 0; q < hamSize; q++)
+    {
+      for(int p = 0; p < hamSize; p++)
+      {
+        ws.d(p, q, a) = v(p, p, a) - v(q, q, a);
+      }
+    }
+  }
+  for(int a = 0; a < latDim; a++)
+  {
+    for(int p = 0; p < latDim; p++)
+    {
+      ws.rotated = v.slice(p) * ws.r.slice(a);
+      ws.rotated -= ws.r.slice(a) * v.slice(p);
+      ws.r_k.slice(p + latDim * a) = (-(ws.r.slice(p) % ws.d.slice(a) + ws.r.slice(a) % ws.d.slice(p)) - ws.rotated)
+                                     % ws.invGap * hBar;
+    }
+  }
+}
+
+/*
+ * r and r_k as used by shiftTensor at the cartesian point k, in the
+ * eigenbasis of H(k); r_k has slice p + dim * a.
+ */
+void
+TightBinding::positionDerivative(const vec &k, cx_cube &r, cx_cube &r_k) const
+{
+  ShiftWorkspace        ws;
+  std::vector<cx_cube>  dH = HamDerivatives(k, 1);
+  
+  eig_sym(ws.energies, ws.U, dH[0].slice(0));
+  rotateSlices(dH[1], ws.U, ws.rotated);
+  buildPosition(dH[1], ws, lat.dim());
+  r = ws.r;
+  r_k = ws.r_k;
+}
+
+//Shift current at one frequency; prints the susceptibility tensor
 cx_vec
-TightBinding::shiftCurrent(double omega, vec A, double T)
+TightBinding::shiftCurrent(double omega, vec A, double T) const
+{
+  vec             omegas(1);
+  omegas(0) = omega;
+  ResponseTensor  sigma = shiftTensor(omegas, T);
+  
+  sigma.tensor(0).print();
+  return sigma.current(conv_to<cx_vec>::from(A)).col(0);
+}
+
+//Shift current for the (real) field A at every frequency of omegas
+cx_mat
+TightBinding::shiftSpectrum(const vec &omegas, const vec &A, double T) const
+{
+  return shiftTensor(omegas, T).current(conv_to<cx_vec>::from(A));
+}
+
+/*
+ * Shift susceptibility sigma(a, b, c) for every frequency of the ascending
+ * grid omegas, from a single pass over the k-mesh. The eigenbasis, r and
+ * r_k depend only on k and are built once per point; each band pair then
+ * adds its (frequency independent) term times the Gaussian weight to the
+ * frequencies within reach of w_mn. The polarisation enters only through
+ * ResponseTensor::current.
+ *
+ * The k-mesh is shared out over the threads with work stealing. Each thread
+ * owns a ShiftWorkspace for the whole integration: derivatives, rotations
+ * and the r, r_k, d tensors are written into its buffers in place, so after
+ * the first k-point nothing of size hamSize^2 x dim is allocated again.
+ * r_k is built once per k for every (a, p) from matrix products, O(N^3)
+ * per component (buildPosition). Only first derivatives of H are needed.
+ * The per-thread tensors are summed at the end.
+ */
+ResponseTensor
+TightBinding::shiftTensor(const vec &omegas, double T) const
 {
   if(lat.dim() != 3)
   {
     throw "method TightBinding::phCurrent : lattice must be of dimension 3";
   }
+  checkFrequencies(omegas);
   
   std::cout << "Attempting to calculate photocurrent."
   << "\n...\n" << std::endl;
   
-  int                   slices = 2, r_flag, r_k_flag, latDim = lat.dim();
-  cx_cube               v, H_2,
-                        r(hamSize, hamSize, latDim),
-                        r_k(hamSize, hamSize, latDim),
-                        d(hamSize, hamSize, latDim),
-			w(hamSize, hamSize, latDim * latDim),
-                        susceptibilityTensor(latDim, latDim, latDim);
-  vec                   k(latDim),
-                        energies;
-  cx_vec                current(latDim);
-  cx_mat                H, U;
-  double                del_mn, del_nm, E_mn, r_mn,
-                        E_f = 15.2886, //eV
+  int                   slices = 2,
+                        latDim = lat.dim(),
+                        side = 2 * (slices / 2) + 1;
+  double                E_f = 15.2886, //eV
                         alpha = 10,
                         dV = std::abs(det(kVecs())) * pow(slices + ((slices + 1) % 2), -latDim),
-                        f_mn, w_mn, cutoff = .0000000000000001;
-  std::complex<double>  susceptibilityTerm;
+                        cutoff = .0000000000000001;
+  uword                 numOmega = omegas.n_elem;
+  cx_cube               susceptibility(latDim, latDim * latDim, numOmega, fill::zeros);  //(a, b + latDim c, omega)
+  std::vector<ShiftWorkspace> work(numThreads);
   
-  susceptibilityTensor.zeros();
+  for(int t = 0; t < numThreads; t++)
+  {
+    work[t].susceptibility.zeros(latDim, latDim * latDim, numOmega);
+    work[t].weights.set_size(numOmega);
+    work[t].zeroPairs = 0;
+  }
   
-  //define mesh in k-space
-  for(int k1 = -slices / 2; k1 <= slices / 2; k1++)
+  //define mesh in k-space; H and dH/dk come from the FFT mesh one slab
+  //(side^2 points) at a time, and the points of a slab are shared out
+  HamMesh               mesh(*this, side, side, side, 1);
+  std::vector<cx_mat>   Hs(side * side);
+  std::vector<cx_cube>  vs(side * side);
+  bool                  more = mesh.next();
+  while(more)
   {
-    for(int k2 = -slices / 2; k2 <= slices / 2; k2++)
+    int batch = 0;
+    for(; more && batch < side * side; batch++, more = mesh.next())
     {
-      for(int k3 = -slices / 2; k3 <= slices / 2; k3++)
+      Hs[batch] = mesh.H();
+      vs[batch] = mesh.dH();
+    }
+    
+    stealingFor(batch, numThreads, [&](int pt, int thread)
+    {
+      ShiftWorkspace  &ws = work[thread];
+      int             r_flag = 1;
+      double          f_mn, w_mn;
+      uword           first, last;
+      std::complex<double>  susceptibilityTerm;
+      cx_cube         &v = vs[pt],
+                      &r = ws.r,
+                      &r_k = ws.r_k;
+      vec             &energies = ws.energies;
+      
+      eig_sym(energies, ws.U, Hs[pt]);
+      
+      for(int m = 0; m < hamSize; m++)
       {
-        
-        k << k1 << k2 << k3;
-        k /= slices + 1;
-        //k.print();
-	//std::cout << std::endl;
-	k = -kVecs() * k;
-        H = Ham(k);
-
-        eig_sym(energies, U, H);
-        r_flag = 1;
-        
-        for(int m = 0; m < hamSize; m++)
+        for(int n = 0; n < hamSize; n++)
         {
-          for(int n = 0; n < hamSize; n++)
+          f_mn = fermiDirac(energies(m), E_f, T) - fermiDirac(energies(n), E_f, T);
+          
+          if(std::abs(f_mn) > cutoff)
           {
-            f_mn = fermiDirac(energies(m), E_f, T) - fermiDirac(energies(n), E_f, T);
-            
-            if(std::abs(f_mn) > cutoff)
+            w_mn = (energies(m) - energies(n)) / hBar; 
+            ws.zeroPairs += (w_mn == 0);
+            deltaWindow(omegas, w_mn, alpha, cutoff, first, last);
+            if(first < last)
             {
-	      w_mn = (energies(m) - energies(n)) / hBar; 
-	      if(w_mn == 0) std::cout << m << "  " << n << "  " << w_mn << std::endl;	
-              del_mn = delta(hBar * (w_mn - omega), alpha);
-              if(del_mn > cutoff)
+              if(r_flag) //builds v, r, d and r_k in the eigenbasis, once per k
               {
-                if(r_flag) //builds v, r, d, w matrices
-                {
-                  
-                  v = expandHam_order1(k);
-		  w = expandHam_order2(k);
-		 
-                  for(int i = 0; i < latDim; i++)
-                  {
-                    v.slice(i) = U.t() * v.slice(i) * U;
-		    for(int j = 0; j < latDim; j++)
-		    {
-		      w.slice(i * latDim + j) = U.t() * w.slice(i * latDim + j) * U;
-		    }
-                  }
-                  
-                  for(int p = 0; p < hamSize; p++)
-                  {
-                    for(int q = 0; q < hamSize; q++)
-                    {
-		      if(p != q)
-		      {
-			r.tube(p, q) = -v.tube(p, q) * I / (energies(p) - energies(q));
-		      }
-		      else
-		      {
-			r.tube(p, q).zeros();
-		      }	
-		      d.tube(p, q) = v.tube(p, p) - v.tube(q, q);
-                    }
-                  }
-                  r_flag = 0;
-                }
-                
-                //calculate contribution to rank 3 tensor at each k, m, n
-                for(int a = 0; a < latDim; a++)
+                rotateSlices(v, ws.U, ws.rotated);
+                buildPosition(v, ws, latDim);
+                r_flag = 0;
+              }
+            
+              //Gaussian weights of the frequencies this pair reaches
+              for(uword i = first; i < last; i++)
+              {
+                ws.weights(i) = delta(hBar * (w_mn - omegas(i)), alpha);
+              }
+            
+              //calculate contribution to rank 3 tensor at each k, m, n
+              for(int a = 0; a < latDim; a++)
+              {
+                for(int b = 0; b < latDim; b++)
                 {
-                  r_k_flag = 1;
-                  for(int b = 0; b < latDim; b++)
+                  for(int c = 0; c < latDim; c++)
                   {
-                    for(int c = 0; c < latDim; c++)
+                    susceptibilityTerm = f_mn * (r(m, n, b) * r_k(n, m, c + latDim * a) + r(m, n, c) 
+                                                * r_k(n, m, b + latDim * a)) * dV;
+                    for(uword i = first; i < last; i++)
                     {
-                      if(r_k_flag) //builds rk matrix
-                      {
-                        for(int i = 0; i < hamSize; i++)
-                        {
-                          for(int j = 0; j < hamSize; j++)
-                          {
-			    if(i != j)
-			    {
-			      for(int p = 0; p < latDim; p++)
-                              {
-                                r_k(i, j, p) = -(r(i, j, p) * d(i, j, a) + r(i, j, a) * d(i, j, p)); 
-                                for(int q = 0; q < hamSize; q++)
-                                {
-                                  r_k(i, j, p) -= v(i, q, p) * r(q, j, a) - r(i, q, a) * v(q, j, p);
-                                }
-                                r_k(i, j, p) *= hBar / (energies(i) - energies(j));
-				//r_k(i, j, p) -= w(i, j, p * latDim + a);
-                              }
-			    }
-                            
-                          }
-                        }
-			r_k.print();
-                        r_k_flag = 0;
-                      }
-                      
-		      susceptibilityTerm = f_mn * (r(m, n, b) * r_k(n, m, c) + r(m, n, c) 
-							    * r_k(n, m, b)) * del_mn * dV;
-                      susceptibilityTensor(a, b, c) += susceptibilityTerm;
-                      current(a) += susceptibilityTerm;
+                      ws.susceptibility(a, b + latDim * c, i) += susceptibilityTerm * ws.weights(i);
                     }
                   }
                 }
@@ -838,21 +1895,40 @@ TightBinding::shiftCurrent(double omega, vec A, double T)
           }
         }
       }
-    }
+    });
+  }
+  
+  long  zeroPairs = 0;
+  for(int t = 0; t < numThreads; t++)
+  {
+    susceptibility += work[t].susceptibility;
+    zeroPairs += work[t].zeroPairs;
+  }
+  if(zeroPairs > 0)
+  {
+    std::cout << "Warning: " << zeroPairs << " band pairs with different occupation but w_mn = 0" << std::endl;
   }
-  susceptibilityTensor.print();
-  return current;
+  return ResponseTensor(omegas, susceptibility);
 }
 
 
+/*
+ * Band gap over a res x res grid on the plane with miller indices (h k l).
+ * The grid is cut into tiles that are swept in parallel with work stealing;
+ * each point gets an exact eigRange solve of the two middle bands (in single
+ * precision with refinement of small gaps after setMixedPrecision), or with
+ * setGapTracking the bands are followed point to point along a serpentine
+ * path within the tile. Each thread keeps its own tracker and k-point buffer,
+ * and the gaps are written in grid order once all tiles are done.
+ */
 int
-TightBinding::plotGap(int h, int k, int l) //integers represent miller indices
+TightBinding::plotGap(int h, int k, int l, int res) const //integers represent miller indices
 {
   mat             vertices(lat.dim(), 3);
   //Must find set of vertices in R^3 outlining our plane
   std::stringstream ss;
   ss << h << k << l;
-  std::string     path = "../data/" + seedname + "_gap_" + ss.str() + ".dat";
+  std::string     path = "../data/" + seedname + "_gap_" + ss.str();
   
   /*vertices << -0.72823 << -0.72823 << -.27176 << endr
              << .27176   << .27176   << 0.72823 << endr
@@ -864,25 +1940,121 @@ TightBinding::plotGap(int h, int k, int l) //integers represent miller indices
     
   vertices = trans(3 * vertices);
     
-  field<vec>      pts = grid(vertices, 200);
-  std::ofstream   ofs(path);
+  field<vec>      pts = grid(vertices, res);
+  std::unique_ptr<TextWriter> ofs;
+  if(outputFormat & textOutput)
+  {
+    ofs.reset(new TextWriter(path + ".dat", 6));
+  }
 
   int     ht = pts.n_rows,
           wid = pts.n_cols,
           len = pts.n_slices;
+  mat     kOut,       //binary output: k and gap of every grid point
+          gapOut;
+  if(outputFormat & binaryOutput)
+  {
+    kOut.set_size(lat.dim(), wid * ht * len);
+    gapOut.set_size(wid * ht * len, 1);
+  }
     
   std::cout << "Calculating bandgap along " + ss.str() + " plane.\n..." << std::endl;
+  int     tile = 16,
+          tilesWide = (wid + tile - 1) / tile,
+          tilesHigh = (ht + tile - 1) / tile;
+  std::vector<SubspaceSolver> trackers(numThreads, SubspaceSolver(hamSize / 2 - 1, hamSize / 2));
+  std::vector<mat>            ks(numThreads, mat(lat.dim(), tile * tile));
+  
   for(int k = 0; k < len; k++)
   {
+    mat             gaps(wid, ht);
+    
+    stealingFor(tilesWide * tilesHigh, numThreads, [&](int t, int thread)
+    {
+      int     i0 = (t / tilesHigh) * tile,
+              j0 = (t % tilesHigh) * tile,
+              iN = std::min(i0 + tile, wid) - i0,
+              jN = std::min(j0 + tile, ht) - j0,
+              n = 0;
+      vec     energies;
+      
+      //rows of the tile are swept in alternating directions so that
+      //consecutive points are always neighbours
+      for(int i = 0; i < iN; i++)
+      {
+        for(int step = 0; step < jN; step++)
+        {
+          int j = (i % 2) ? jN - 1 - step : step;
+          ks[thread].col(n++) = pts(i0 + i, j0 + j, k);
+        }
+      }
+      bool      screen = mixedPrecision && !gapTracking;
+      cx_cube   H;
+      cx_fcube  Hf;
+      if(screen)
+      {
+        Hf = HamBatchSingle(ks[thread].cols(0, n - 1));
+      }
+      else
+      {
+        H = HamBatch(ks[thread].cols(0, n - 1));
+      }
+      
+      trackers[thread].reset();
+      n = 0;
+      for(int i = 0; i < iN; i++)
+      {
+        for(int step = 0; step < jN; step++)
+        {
+          int j = (i % 2) ? jN - 1 - step : step;
+          if(screen)
+          {
+            gaps(i0 + i, j0 + j) = screenGap(Hf.slice(n), ks[thread].col(n));
+            n++;
+            continue;
+          }
+          if(!gapTracking)
+          {
+            gaps(i0 + i, j0 + j) = gapFromHam(H.slice(n++));
+            continue;
+          }
+          energies = trackers[thread].solve(H.slice(n++));
+          gaps(i0 + i, j0 + j) = energies(1) - energies(0);
+        }
+      }
+    });
+    
     for(int i = 0; i < wid; i++)
     {
       for(int j = 0; j < ht; j++)
       {
-        ofs << i + 1 << "      " << j + 1 << "      "
-            << bandGap(pts(i, j, k)) << std::endl;
+        if(ofs)
+        {
+          ofs->field(i + 1);
+          ofs->field(j + 1);
+          ofs->field(gaps(i, j));
+          ofs->endRow();
+        }
+        if(!gapOut.is_empty())
+        {
+          uword row = (k * wid + i) * ht + j;
+          kOut.col(row) = pts(i, j, k);
+          gapOut(row) = gaps(i, j);
+        }
       }
     }
   }
+  if(ofs)
+  {
+    ofs->flush();
+  }
+  //a single column, labelled with the upper of the two bands
+  if(outputFormat & binaryOutput)
+  {
+    Col<sword>  index(1);
+    index(0) = hamSize / 2;
+    writeColumns(path + ".tbcol", kOut, index, gapOut);
+  }
   return 1;
 }
 